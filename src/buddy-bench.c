@@ -0,0 +1,1415 @@
+/* Author: Garrett Scholtes
+ * Date:   2015-11-18
+ *
+ * buddy-bench.c - Userspace microbenchmark for the allocator core.
+ * Links buddy-core.c directly, so no module or ioctl is involved.
+ *
+ * With -d it instead benchmarks the loaded module through /dev/mem_dev.
+ *
+ * Usage: ./buddy-bench [-f] [-s] [-d] [-r trace [mem_size [block_size]]]
+ *     -f    benchmark first-fit instead of best-fit free lists
+ *     -s    benchmark the segregated policy instead of best-fit free lists
+ *     -d    benchmark the device (single vs batched ioctls, thread scaling,
+ *           all-cores latency).  Reload the module with magazines=0 and run
+ *           again to compare against running without the per-CPU caches
+ *     -r    replay a trace recorded by the module (loaded with record=1) with
+ *           cat /sys/kernel/debug/buddy/trace > trace, on an arena of the
+ *           given geometry.  By default, the smallest arena of 16 byte blocks
+ *           that held every block in the trace
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "buddy-core.h"
+#include "buddy-ioctl.c"
+
+#define BENCH_BLOCK_SIZE 16
+// Roughly how many operations to time per workload
+#define BENCH_OPS (1<<21)
+// Alloc/free pairs done by each thread in the scaling benchmarks
+#define THREAD_OPS (1<<17)
+#define MAX_THREADS 64
+// Get/free pairs done by each thread in the device benchmarks
+#define DEVICE_THREAD_OPS (1<<13)
+
+static void *bench_alloc(size_t size) {
+    return malloc(size);
+}
+
+static const struct buddy_hooks bench_hooks = {
+    .alloc = bench_alloc,
+    .free = free
+};
+
+static void bench_mutex_lock(void *lock) {
+    pthread_mutex_lock(lock);
+}
+
+static void bench_mutex_unlock(void *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+// Same as bench_hooks, but for arenas shared between threads
+static const struct buddy_hooks bench_locked_hooks = {
+    .alloc = bench_alloc,
+    .free = free,
+    .lock = bench_mutex_lock,
+    .unlock = bench_mutex_unlock
+};
+
+static enum buddy_policy use_policy = BUDDY_BEST_FIT;
+
+static const char *const policy_names[] = {"best-fit", "first-fit", "segregated"};
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(int depth, const char *workload, long ops, double ns) {
+    printf("%5d  %-8s %10ld %10.1f %14.0f\n", depth, workload, ops, ns / ops, ops * 1e9 / ns);
+}
+
+static void setup(struct buddy_arena *arena, int depth) {
+    if(buddy_init(arena, depth, BENCH_BLOCK_SIZE, &bench_hooks, NULL) < 0) {
+        fprintf(stderr, "buddy_init failed for depth %d\n", depth);
+        exit(1);
+    }
+    arena->policy = use_policy;
+}
+
+// Fill the arena with minimum-size blocks, then free them all, and time each half
+static void bench_alloc_free(int depth) {
+    struct buddy_arena arena;
+    int num_blocks = 1<<depth;
+    int rounds = BENCH_OPS / num_blocks > 0 ? BENCH_OPS / num_blocks : 1;
+    int *refs = malloc(num_blocks * sizeof(int));
+    double alloc_ns = 0, free_ns = 0, t;
+    int r, i;
+
+    setup(&arena, depth);
+    for(r = 0; r < rounds; r++) {
+        t = now_ns();
+        for(i = 0; i < num_blocks; i++) {
+            refs[i] = buddy_get_mem(&arena, BENCH_BLOCK_SIZE);
+        }
+        alloc_ns += now_ns() - t;
+
+        t = now_ns();
+        for(i = 0; i < num_blocks; i++) {
+            buddy_free_mem(&arena, refs[i]);
+        }
+        free_ns += now_ns() - t;
+    }
+    report(depth, "alloc", (long)rounds * num_blocks, alloc_ns);
+    report(depth, "free", (long)rounds * num_blocks, free_ns);
+
+    buddy_destroy(&arena);
+    free(refs);
+}
+
+// Random mix of allocations (1 to 8 blocks worth) and frees of random live
+// blocks.  Uses a fixed seed so every run replays the same sequence
+static void bench_mixed(int depth) {
+    struct buddy_arena arena;
+    int capacity = 1<<depth;
+    int *live = malloc(capacity * sizeof(int));
+    int num_live = 0;
+    long i;
+    int ref, victim;
+    double t;
+
+    setup(&arena, depth);
+    srand(42);
+    t = now_ns();
+    for(i = 0; i < BENCH_OPS; i++) {
+        if(num_live == 0 || (num_live < capacity && rand() & 1)) {
+            ref = buddy_get_mem(&arena, 1 + rand() % (8 * BENCH_BLOCK_SIZE));
+            if(ref >= 0) live[num_live++] = ref;
+        } else {
+            victim = rand() % num_live;
+            buddy_free_mem(&arena, live[victim]);
+            live[victim] = live[--num_live];
+        }
+    }
+    report(depth, "mixed", BENCH_OPS, now_ns() - t);
+
+    buddy_destroy(&arena);
+    free(live);
+}
+
+/// --------------------------- LAZY COALESCING ---------------------------- ///
+
+#define COALESCE_DEPTH 16
+
+// One row of bench_coalescing for the given lazy_limit (0 is eager)
+static void run_coalescing(int lazy_limit) {
+    struct buddy_arena arena;
+    struct buddy_stats stats;
+    int target = (1<<COALESCE_DEPTH) / 8;
+    int *live = malloc(target * sizeof(int));
+    int num_live = 0;
+    int ref, victim, size, order, fragments;
+    long fails = 0;
+    long i;
+    double churn_ns, mixed_ns, t;
+    char label[32];
+
+    // Same-size churn
+    setup(&arena, COALESCE_DEPTH);
+    arena.lazy_limit = lazy_limit;
+    t = now_ns();
+    for(i = 0; i < BENCH_OPS; i++) {
+        ref = buddy_get_mem(&arena, BENCH_BLOCK_SIZE);
+        buddy_free_mem(&arena, ref);
+    }
+    churn_ns = now_ns() - t;
+    buddy_destroy(&arena);
+
+    // Mixed sizes with about two thirds of the arena live
+    setup(&arena, COALESCE_DEPTH);
+    arena.lazy_limit = lazy_limit;
+    srand(42);
+    t = now_ns();
+    for(i = 0; i < BENCH_OPS; i++) {
+        if(num_live < target && (num_live == 0 || rand() & 1)) {
+            ref = buddy_get_mem(&arena, 1 + rand() % (8 * BENCH_BLOCK_SIZE));
+            if(ref >= 0) live[num_live++] = ref;
+            else fails++;
+        } else {
+            victim = rand() % num_live;
+            buddy_free_mem(&arena, live[victim]);
+            live[victim] = live[--num_live];
+        }
+    }
+    mixed_ns = now_ns() - t;
+
+    // The largest block still to be had.  The first failed probe makes a
+    // lazy arena merge everything, so the fragment count after it is fair
+    for(size = arena.mem_size; size >= BENCH_BLOCK_SIZE; size >>= 1) {
+        ref = buddy_get_mem(&arena, size);
+        if(ref >= 0) {
+            buddy_free_mem(&arena, ref);
+            break;
+        }
+    }
+    buddy_get_stats(&arena, &stats);
+    fragments = 0;
+    for(order = 0; order <= arena.depth; order++) {
+        fragments += stats.free_blocks[order];
+    }
+
+    if(lazy_limit) snprintf(label, sizeof(label), "lazy %d", lazy_limit);
+    else snprintf(label, sizeof(label), "eager");
+    printf("%-10s %12.1f %12.1f %10ld %10d %10d\n", label, churn_ns / BENCH_OPS,
+        mixed_ns / BENCH_OPS, fails, fragments, size);
+
+    buddy_destroy(&arena);
+    free(live);
+}
+
+// Merging on every free against lazy coalescing at a few watermarks.  churn
+// gets and frees one minimum block over and over; mixed is bench_mixed with
+// the arena kept about two thirds full.  Afterwards it reports the number of
+// free fragments and the largest block that can still be allocated
+static void bench_coalescing() {
+    int limits[] = {0, 16, 256, 4096};
+    unsigned int l;
+
+    printf("depth %d\n", COALESCE_DEPTH);
+    printf("%-10s %12s %12s %10s %10s %10s\n", "mode", "churn ns/op", "mixed ns/op",
+        "failed", "fragments", "largest");
+    for(l = 0; l < sizeof(limits)/sizeof(limits[0]); l++) {
+        run_coalescing(limits[l]);
+    }
+}
+
+/// ----------------------- SIZE CLASSES, EXACT SIZES ---------------------- ///
+
+#define FILL_DEPTH 14
+
+enum fill_mode {FILL_BUDDY, FILL_SLABS, FILL_EXACT};
+
+static const char *const fill_mode_names[] = {"buddy", "slabs", "exact"};
+
+// Fills an arena with objects of random sizes up to max_size bytes until 1000
+// requests in a row fail, and reports how much of the arena ended up holding
+// requested bytes
+static void run_fill(int max_size, enum fill_mode mode) {
+    struct buddy_arena arena;
+    long requested = 0;
+    long objects = 0;
+    long attempts = 0;
+    int misses = 0;
+    int size, ref;
+    double t;
+
+    setup(&arena, FILL_DEPTH);
+    if(mode == FILL_SLABS && buddy_enable_slabs(&arena) < 0) {
+        fprintf(stderr, "buddy_enable_slabs failed\n");
+        exit(1);
+    }
+    srand(42);
+    t = now_ns();
+    while(misses < 1000) {
+        size = 1 + rand() % max_size;
+        ref = mode == FILL_EXACT ? buddy_get_mem_exact(&arena, size) : buddy_get_mem(&arena, size);
+        attempts++;
+        if(ref < 0) {
+            misses++;
+            continue;
+        }
+        misses = 0;
+        requested += size;
+        objects++;
+    }
+    t = now_ns() - t;
+
+    printf("%5d  %-8s %10ld %9.1f%% %10.1f\n", max_size, fill_mode_names[mode],
+        objects, 100.0 * requested / arena.mem_size, t / attempts);
+
+    buddy_destroy(&arena);
+}
+
+// Memory utilization for small objects with and without size classes, and
+// for larger objects with and without exact sizes
+static void bench_fill() {
+    int small_sizes[] = {8, 24, 64, 200};
+    int large_sizes[] = {100, 1000, 10000};
+    unsigned int m;
+
+    printf("depth %d, objects of 1 to max bytes\n", FILL_DEPTH);
+    printf("%5s  %-8s %10s %10s %10s\n", "max", "layer", "objects", "utilized", "ns/request");
+    for(m = 0; m < sizeof(small_sizes)/sizeof(small_sizes[0]); m++) {
+        run_fill(small_sizes[m], FILL_BUDDY);
+        run_fill(small_sizes[m], FILL_SLABS);
+    }
+    for(m = 0; m < sizeof(large_sizes)/sizeof(large_sizes[0]); m++) {
+        run_fill(large_sizes[m], FILL_BUDDY);
+        run_fill(large_sizes[m], FILL_EXACT);
+    }
+}
+
+/// ------------------------- AGING AND COMPACTION ------------------------- ///
+
+#define AGING_DEPTH 14
+#define AGING_EPOCHS 10
+#define AGING_EPOCH_OPS (1<<17)
+
+struct aging {
+    struct buddy_arena arena;
+    char *memory;
+    int *live;
+    int *sizes;
+    int num_live;
+    int used;
+    unsigned int seed;
+};
+
+static void aging_move(void *ctx, long dst, long src, long size) {
+    char *memory = ctx;
+
+    memmove(memory + dst, memory + src, size);
+}
+
+// The biggest free block in the arena, in bytes
+static long largest_free(struct buddy_arena *arena) {
+    struct buddy_stats stats;
+    int order;
+
+    buddy_get_stats(arena, &stats);
+    for(order = arena->depth; order >= 0; order--) {
+        if(stats.free_blocks[order]) return (long)arena->block_size << order;
+    }
+
+    return 0;
+}
+
+static void aging_setup(struct aging *ag) {
+    setup(&ag->arena, AGING_DEPTH);
+    if(buddy_enable_handles(&ag->arena) < 0) {
+        fprintf(stderr, "buddy_enable_handles failed\n");
+        exit(1);
+    }
+    ag->memory = malloc(ag->arena.mem_size);
+    ag->live = malloc(ag->arena.max_handles * sizeof(int));
+    ag->sizes = malloc(ag->arena.max_handles * sizeof(int));
+    ag->num_live = 0;
+    ag->used = 0;
+    ag->seed = 42;
+}
+
+// One epoch of random handle gets and frees of 1 to 16 blocks worth, keeping
+// about three quarters of the arena in use
+static void aging_epoch(struct aging *ag) {
+    int handle, size, victim;
+    long i;
+
+    for(i = 0; i < AGING_EPOCH_OPS; i++) {
+        if(ag->num_live == 0 || (ag->used < ag->arena.mem_size / 4 * 3 && rand_r(&ag->seed) % 3)) {
+            size = 1 + rand_r(&ag->seed) % (16 * BENCH_BLOCK_SIZE);
+            handle = buddy_get_handle(&ag->arena, size);
+            if(handle < 0) {
+                continue;
+            }
+            ag->sizes[ag->num_live] = ag->arena.block_size << buddy_size_to_order(&ag->arena, size);
+            ag->live[ag->num_live++] = handle;
+            ag->used += ag->sizes[ag->num_live - 1];
+        } else {
+            victim = rand_r(&ag->seed) % ag->num_live;
+            buddy_free_handle(&ag->arena, ag->live[victim]);
+            ag->used -= ag->sizes[victim];
+            ag->live[victim] = ag->live[--ag->num_live];
+            ag->sizes[victim] = ag->sizes[ag->num_live];
+        }
+    }
+}
+
+static void aging_destroy(struct aging *ag) {
+    buddy_destroy(&ag->arena);
+    free(ag->memory);
+    free(ag->live);
+    free(ag->sizes);
+}
+
+// Two arenas age through the same random workload, one of them compacted
+// after every epoch.  Each row reports the bytes in use, the largest free
+// block in both, and what compacting cost
+static void bench_aging() {
+    struct aging plain, compacted;
+    int moves, n;
+    double t;
+    int epoch;
+
+    aging_setup(&plain);
+    aging_setup(&compacted);
+
+    printf("depth %d, objects of 1 to %d bytes, about 3/4 of the arena in use\n",
+        AGING_DEPTH, 16 * BENCH_BLOCK_SIZE);
+    printf("%5s %10s %10s %10s %8s %12s\n", "epoch", "used", "largest",
+        "compacted", "moves", "compact us");
+    for(epoch = 1; epoch <= AGING_EPOCHS; epoch++) {
+        aging_epoch(&plain);
+        aging_epoch(&compacted);
+
+        moves = 0;
+        t = now_ns();
+        while((n = buddy_compact(&compacted.arena, 1<<10, aging_move, compacted.memory)) > 0) {
+            moves += n;
+        }
+        t = now_ns() - t;
+
+        printf("%5d %10d %10ld %10ld %8d %12.1f\n", epoch, plain.used,
+            largest_free(&plain.arena), largest_free(&compacted.arena), moves, t / 1e3);
+    }
+
+    aging_destroy(&plain);
+    aging_destroy(&compacted);
+}
+
+/// -------------------------- PLACEMENT POLICIES -------------------------- ///
+
+#define TRACE_DEPTH 16
+#define TRACE_OPS (1<<19)
+// How often the replay samples the external fragmentation
+#define TRACE_SAMPLE 1024
+
+// One step of a recorded trace: allocate size bytes into slot, or free
+// whatever slot holds if size is 0
+struct trace_op {
+    int size;
+    int slot;
+};
+
+// Records a trace of mostly small objects (16 to 256 bytes) with one in ten
+// large (1 to 16 KB), keeping about 70% of the arena requested.  Slots are
+// reused as they are freed, so slot numbers stay below TRACE_OPS
+static struct trace_op *record_trace(int mem_size) {
+    struct trace_op *trace = malloc(TRACE_OPS * sizeof(struct trace_op));
+    int *live = malloc(TRACE_OPS * sizeof(int));
+    int *live_size = malloc(TRACE_OPS * sizeof(int));
+    int *free_slots = malloc(TRACE_OPS * sizeof(int));
+    int num_live = 0;
+    int num_free = 0;
+    int next_slot = 0;
+    long requested = 0;
+    int victim, size;
+    long i;
+
+    srand(42);
+    for(i = 0; i < TRACE_OPS; i++) {
+        if(num_live == 0 || (requested < mem_size / 10 * 7 && rand() % 3)) {
+            if(rand() % 10) size = 16 + rand() % 241;
+            else size = 1024 + rand() % (15 * 1024 + 1);
+            trace[i].size = size;
+            trace[i].slot = num_free ? free_slots[--num_free] : next_slot++;
+            live[num_live] = trace[i].slot;
+            live_size[num_live++] = size;
+            requested += size;
+        } else {
+            victim = rand() % num_live;
+            trace[i].size = 0;
+            trace[i].slot = live[victim];
+            free_slots[num_free++] = live[victim];
+            requested -= live_size[victim];
+            live[victim] = live[--num_live];
+            live_size[victim] = live_size[num_live];
+        }
+    }
+
+    free(live);
+    free(live_size);
+    free(free_slots);
+    return trace;
+}
+
+// Free bytes that can't be had in one block, as a percentage of all free bytes
+static double external_fragmentation(struct buddy_arena *arena) {
+    struct buddy_stats stats;
+    long free_bytes = 0;
+    long largest = 0;
+    int order;
+
+    buddy_get_stats(arena, &stats);
+    for(order = 0; order <= arena->depth; order++) {
+        free_bytes += (long)stats.free_blocks[order] * ((long)arena->block_size << order);
+        if(stats.free_blocks[order]) largest = (long)arena->block_size << order;
+    }
+
+    return free_bytes ? 100.0 * (free_bytes - largest) / free_bytes : 0;
+}
+
+// Replays trace on a fresh arena with the given policy
+static void replay_trace(const struct trace_op *trace, enum buddy_policy policy) {
+    struct buddy_arena arena;
+    int *slots = malloc(TRACE_OPS * sizeof(int));
+    long small_fails = 0;
+    long large_fails = 0;
+    double fragmentation = 0;
+    int samples = 0;
+    double t, elapsed = 0;
+    long i;
+
+    setup(&arena, TRACE_DEPTH);
+    arena.policy = policy;
+    for(i = 0; i < TRACE_OPS; i++) {
+        t = now_ns();
+        if(trace[i].size) {
+            slots[trace[i].slot] = buddy_get_mem(&arena, trace[i].size);
+        } else if(slots[trace[i].slot] >= 0) {
+            buddy_free_mem(&arena, slots[trace[i].slot]);
+        }
+        elapsed += now_ns() - t;
+
+        if(trace[i].size && slots[trace[i].slot] < 0) {
+            if(trace[i].size < 1024) small_fails++;
+            else large_fails++;
+        }
+        if(i % TRACE_SAMPLE == 0) {
+            fragmentation += external_fragmentation(&arena);
+            samples++;
+        }
+    }
+
+    printf("%-12s %10ld %10ld %11.1f%% %10ld %10.1f\n", policy_names[policy], small_fails,
+        large_fails, fragmentation / samples, largest_free(&arena), elapsed / TRACE_OPS);
+
+    buddy_destroy(&arena);
+    free(slots);
+}
+
+// The same recorded trace replayed under every placement policy.  Reports
+// failed small and large requests, the average external fragmentation, the
+// largest free block at the end, and the cost of each operation
+static void bench_policies() {
+    struct trace_op *trace = record_trace(BENCH_BLOCK_SIZE << TRACE_DEPTH);
+
+    printf("depth %d, %d ops, 90%% 16-256 B and 10%% 1-16 KB, about 70%% requested\n",
+        TRACE_DEPTH, TRACE_OPS);
+    printf("%-12s %10s %10s %12s %10s %10s\n", "policy", "small fail", "large fail",
+        "ext. frag", "largest", "ns/op");
+    replay_trace(trace, BUDDY_BEST_FIT);
+    replay_trace(trace, BUDDY_FIRST_FIT);
+    replay_trace(trace, BUDDY_SEGREGATED);
+
+    free(trace);
+}
+
+/// ---------------------------- SCRATCH ARENAS ---------------------------- ///
+
+#define SCRATCH_ROUNDS 64
+
+// A scratch arena is filled with n small objects per request and emptied
+// afterwards, either one buddy_free_mem at a time or with one buddy_reset
+static void bench_reset() {
+    struct buddy_arena arena;
+    int *refs = malloc((1<<16) * sizeof(int));
+    double free_ns, reset_ns, t;
+    int n, r, i;
+
+    setup(&arena, 16);
+    printf("%8s %14s %14s\n", "objects", "free_mem us", "reset us");
+    for(n = 16; n <= (1<<16); n <<= 2) {
+        free_ns = reset_ns = 0;
+        for(r = 0; r < SCRATCH_ROUNDS; r++) {
+            for(i = 0; i < n; i++) refs[i] = buddy_get_mem(&arena, BENCH_BLOCK_SIZE);
+            t = now_ns();
+            for(i = 0; i < n; i++) buddy_free_mem(&arena, refs[i]);
+            free_ns += now_ns() - t;
+
+            for(i = 0; i < n; i++) refs[i] = buddy_get_mem(&arena, BENCH_BLOCK_SIZE);
+            t = now_ns();
+            buddy_reset(&arena);
+            reset_ns += now_ns() - t;
+        }
+        printf("%8d %14.2f %14.2f\n", n, free_ns / SCRATCH_ROUNDS / 1e3, reset_ns / SCRATCH_ROUNDS / 1e3);
+    }
+
+    buddy_destroy(&arena);
+    free(refs);
+}
+
+/// ------------------------------- SNAPSHOTS ------------------------------ ///
+
+#define SNAPSHOT_FILE "/tmp/buddy-bench.snap"
+
+// Runs trace on arena, filling every block it gets in memory with its slot
+// number.  Returns the time taken
+static double fill_from_trace(struct buddy_arena *arena, char *memory, const struct trace_op *trace, int *slots) {
+    double t = now_ns();
+    long i;
+
+    for(i = 0; i < TRACE_OPS; i++) {
+        if(trace[i].size) {
+            slots[trace[i].slot] = buddy_get_mem(arena, trace[i].size);
+            if(slots[trace[i].slot] >= 0) memset(memory + slots[trace[i].slot], trace[i].slot, trace[i].size);
+        } else if(slots[trace[i].slot] >= 0) {
+            buddy_free_mem(arena, slots[trace[i].slot]);
+        }
+    }
+
+    return now_ns() - t;
+}
+
+// Writes a snapshot of arena, whose contents are memory, to SNAPSHOT_FILE.
+// Returns the time taken, or a negative number on error
+static double save_core_snapshot(struct buddy_arena *arena, char *memory) {
+    long size = buddy_snapshot_size(arena);
+    char *state = malloc(size);
+    double t = now_ns();
+    FILE *f;
+    int ok;
+
+    f = fopen(SNAPSHOT_FILE, "w");
+    ok = f && buddy_snapshot(arena, state, size) == size && fwrite(state, size, 1, f) == 1 &&
+         fwrite(memory, arena->mem_size, 1, f) == 1;
+    ok = f && fclose(f) == 0 && ok;
+    t = now_ns() - t;
+    free(state);
+
+    return ok ? t : -1;
+}
+
+// Brings back the arena a trace leaves behind, bookkeeping and contents, two
+// ways: replaying the whole trace (rewriting the data along the way), and
+// mapping a snapshot file and handing it to buddy_restore.  The mapped
+// contents are used in place, so their pages are only read in as they are
+// touched; the last column touches all of them
+static void bench_snapshot() {
+    struct buddy_arena arena, restored;
+    struct buddy_stats before, after;
+    struct trace_op *trace;
+    struct stat st;
+    char *memory, *map;
+    int *slots = malloc(TRACE_OPS * sizeof(int));
+    double replay_ns, save_ns, restore_ns, touch_ns, t;
+    int depths[] = {TRACE_DEPTH, TRACE_DEPTH + 4};
+    int fd, same;
+    unsigned int d;
+
+    printf("%5s %12s %12s %12s %12s %12s\n", "depth", "snap bytes", "replay ms", "save ms", "restore ms", "+touch ms");
+    for(d = 0; d < sizeof(depths)/sizeof(depths[0]); d++) {
+        trace = record_trace(BENCH_BLOCK_SIZE << depths[d]);
+        memory = calloc(1, BENCH_BLOCK_SIZE << depths[d]);
+
+        setup(&arena, depths[d]);
+        replay_ns = fill_from_trace(&arena, memory, trace, slots);
+        save_ns = save_core_snapshot(&arena, memory);
+        if(save_ns < 0) {
+            fprintf(stderr, "Could not write %s\n", SNAPSHOT_FILE);
+            exit(1);
+        }
+
+        t = now_ns();
+        fd = open(SNAPSHOT_FILE, O_RDONLY);
+        fstat(fd, &st);
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED || buddy_restore(&restored, map, st.st_size, &bench_hooks, NULL) < 0) {
+            fprintf(stderr, "Could not restore %s\n", SNAPSHOT_FILE);
+            exit(1);
+        }
+        restore_ns = now_ns() - t;
+
+        t = now_ns();
+        same = memcmp(map + ((struct buddy_snapshot *)map)->data_offset, memory, arena.mem_size) == 0;
+        touch_ns = restore_ns + now_ns() - t;
+
+        buddy_get_stats(&arena, &before);
+        buddy_get_stats(&restored, &after);
+        same = same && memcmp(before.free_blocks, after.free_blocks, sizeof(before.free_blocks)) == 0;
+        printf("%5d %12ld %12.2f %12.2f %12.2f %12.2f%s\n", depths[d], (long)st.st_size, replay_ns / 1e6,
+            save_ns / 1e6, restore_ns / 1e6, touch_ns / 1e6, same ? "" : "  (MISMATCH)");
+
+        munmap(map, st.st_size);
+        buddy_destroy(&restored);
+        buddy_destroy(&arena);
+        free(memory);
+        free(trace);
+    }
+
+    unlink(SNAPSHOT_FILE);
+    free(slots);
+}
+
+/// --------------------------- RECORDED TRACES ---------------------------- ///
+
+// A recorded operation, ready to replay: refs are replaced by slots, the
+// index of the get that handed the block out
+struct replay_op {
+    int op;
+    long size;
+    long arg;
+    int slot;
+    int failed; // A get that failed when it was recorded
+};
+
+static const struct buddy_record *sort_records;
+
+static int compare_times(const void *a, const void *b) {
+    const struct buddy_record *x = &sort_records[*(const int *)a], *y = &sort_records[*(const int *)b];
+    return (x->time_ns > y->time_ns) - (x->time_ns < y->time_ns);
+}
+
+static int compare_refs(const void *a, const void *b) {
+    const struct buddy_record *x = &sort_records[*(const int *)a], *y = &sort_records[*(const int *)b];
+    if(x->ref != y->ref) return (x->ref > y->ref) - (x->ref < y->ref);
+    return (x->time_ns > y->time_ns) - (x->time_ns < y->time_ns);
+}
+
+// Reads the records in path and puts them in time order, with every free and
+// resize pointing at the slot of the get before it on the same ref.  Returns
+// the ops, or NULL if the file can't be read.  *num_ops is how many there are
+// and *top the end of the highest block the trace held
+static struct replay_op *load_trace(const char *path, long *num_ops, long *top) {
+    struct buddy_record *records;
+    struct replay_op *ops;
+    int *order;
+    long n, i, slot;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if(f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f) / sizeof(struct buddy_record);
+    rewind(f);
+    records = malloc(n * sizeof(struct buddy_record) + 1);
+    order = malloc(n * sizeof(int) + 1);
+    ops = malloc(n * sizeof(struct replay_op) + 1);
+    if((long)fread(records, sizeof(struct buddy_record), n, f) != n) {
+        n = 0;
+    }
+    fclose(f);
+
+    // The CPUs' logs are only in order each on its own
+    sort_records = records;
+    for(i = 0; i < n; i++) order[i] = i;
+    qsort(order, n, sizeof(int), compare_times);
+    *top = 0;
+    for(i = 0; i < n; i++) {
+        ops[i].op = records[order[i]].op;
+        ops[i].size = records[order[i]].size;
+        ops[i].arg = records[order[i]].arg;
+        ops[i].slot = i;
+        ops[i].failed = ops[i].op != BUDDY_RECORD_FREE && ops[i].op != BUDDY_RECORD_RESIZE && records[order[i]].ref < 0;
+        records[order[i]].arg = i;
+        if(ops[i].op != BUDDY_RECORD_FREE && records[order[i]].ref >= 0 &&
+           records[order[i]].ref + (long)records[order[i]].size > *top) {
+            *top = records[order[i]].ref + (long)records[order[i]].size;
+        }
+    }
+
+    // Grouped by ref, a block's get, resizes and free come one after another
+    qsort(order, n, sizeof(int), compare_refs);
+    for(i = 0, slot = -1; i < n; i++) {
+        if(records[order[i]].ref < 0) {
+            continue;
+        }
+        if(i == 0 || records[order[i]].ref != records[order[i-1]].ref) {
+            slot = -1;
+        }
+        if(ops[records[order[i]].arg].op == BUDDY_RECORD_FREE || ops[records[order[i]].arg].op == BUDDY_RECORD_RESIZE) {
+            ops[records[order[i]].arg].slot = slot;
+        } else {
+            slot = records[order[i]].arg;
+        }
+    }
+
+    free(records);
+    free(order);
+    *num_ops = n;
+    return ops;
+}
+
+// Bytes of the arena not on any free list
+static long arena_used(struct buddy_arena *arena) {
+    struct buddy_stats stats;
+    long used = arena->mem_size;
+    int order;
+
+    buddy_get_stats(arena, &stats);
+    for(order = 0; order <= arena->depth; order++) {
+        used -= (long)stats.free_blocks[order] * ((long)arena->block_size << order);
+    }
+
+    return used;
+}
+
+// Replays the recorded trace at path with the chosen policy.  Reports the
+// time per get and free, the most of the arena ever in use, the requests
+// that failed (in the recording and in the replay) and the fragmentation
+static int bench_replay(const char *path, long mem_size, int block_size) {
+    struct buddy_arena arena;
+    struct replay_op *ops;
+    long *slots;
+    long num_ops, top, i, used, peak = 0, ref;
+    long gets = 0, frees = 0, fails = 0, recorded_fails = 0, orphans = 0;
+    double get_ns = 0, free_ns = 0, fragmentation = 0, t;
+    int samples = 0, depth;
+
+    ops = load_trace(path, &num_ops, &top);
+    if(ops == NULL) {
+        perror(path);
+        return 1;
+    }
+    if(mem_size <= 0) {
+        for(mem_size = block_size; mem_size < top; mem_size <<= 1);
+    }
+    for(depth = 0; ((long)block_size << depth) < mem_size; depth++);
+    if(buddy_init(&arena, depth, block_size, &bench_hooks, NULL) < 0) {
+        fprintf(stderr, "buddy_init failed for %ld bytes in blocks of %d\n", mem_size, block_size);
+        return 1;
+    }
+    arena.policy = use_policy;
+    slots = malloc(num_ops * sizeof(long) + 1);
+
+    for(i = 0; i < num_ops; i++) {
+        t = now_ns();
+        switch(ops[i].op) {
+        case BUDDY_RECORD_GET:
+            ref = slots[i] = buddy_get_mem(&arena, ops[i].size);
+            break;
+        case BUDDY_RECORD_GET_ALIGNED:
+            ref = slots[i] = buddy_get_mem_aligned(&arena, ops[i].size, ops[i].arg);
+            break;
+        case BUDDY_RECORD_GET_EXACT:
+            ref = slots[i] = buddy_get_mem_exact(&arena, ops[i].size);
+            break;
+        case BUDDY_RECORD_FREE:
+            ref = ops[i].slot >= 0 && slots[ops[i].slot] >= 0 ? buddy_free_mem(&arena, slots[ops[i].slot]) : -1;
+            break;
+        case BUDDY_RECORD_RESIZE:
+            // Resized in place when recorded, but here it may have to move
+            ref = ops[i].slot >= 0 && slots[ops[i].slot] >= 0 ? buddy_resize(&arena, slots[ops[i].slot], ops[i].size) : -1;
+            if(ref > 0) {
+                ref = buddy_get_mem(&arena, ops[i].size);
+                buddy_free_mem(&arena, slots[ops[i].slot]);
+                slots[ops[i].slot] = ref;
+            }
+            break;
+        default:
+            ref = 0;
+            break;
+        }
+        t = now_ns() - t;
+
+        if(ops[i].op == BUDDY_RECORD_FREE) {
+            free_ns += t;
+            frees++;
+            if(ops[i].slot < 0) orphans++;
+        } else {
+            get_ns += t;
+            gets++;
+            if(ref < 0 && ops[i].slot >= 0) fails++;
+            recorded_fails += ops[i].failed;
+        }
+        if(i % TRACE_SAMPLE == 0) {
+            fragmentation += external_fragmentation(&arena);
+            samples++;
+        }
+        used = arena_used(&arena);
+        if(used > peak) peak = used;
+    }
+
+    printf("%ld records, %ld bytes in blocks of %d, %s\n", num_ops, mem_size, block_size, policy_names[use_policy]);
+    printf("%-24s %12.1f\n", "get/resize ns/op", gets ? get_ns / gets : 0);
+    printf("%-24s %12.1f\n", "free ns/op", frees ? free_ns / frees : 0);
+    printf("%-24s %12ld\n", "peak bytes in use", peak);
+    printf("%-24s %12ld\n", "failed gets, recorded", recorded_fails);
+    printf("%-24s %12ld\n", "failed gets, replayed", fails);
+    printf("%-24s %12ld\n", "frees of unrecorded gets", orphans);
+    printf("%-24s %11.1f%%\n", "avg. ext. fragmentation", samples ? fragmentation / samples : 0);
+    printf("%-24s %11.1f%%\n", "final ext. fragmentation", external_fragmentation(&arena));
+    printf("%-24s %12ld\n", "largest free block", largest_free(&arena));
+
+    buddy_destroy(&arena);
+    free(slots);
+    free(ops);
+    return 0;
+}
+
+/// ---------------------------- THREAD SCALING ---------------------------- ///
+
+struct thread_arg {
+    struct buddy_arena *arena;
+    unsigned int seed;
+    long ops;
+
+    // If not NULL, workers record the latency of each get and free here
+    double *get_lat;
+    double *free_lat;
+};
+
+// Start n threads running worker, wait for them all, and return the wall time
+static double run_threads(int n, void *(*worker)(void *), struct buddy_arena *arena, long *ops) {
+    pthread_t threads[MAX_THREADS];
+    struct thread_arg args[MAX_THREADS];
+    double t;
+    int i;
+
+    t = now_ns();
+    for(i = 0; i < n; i++) {
+        args[i].arena = arena;
+        args[i].seed = i + 1;
+        args[i].ops = 0;
+        args[i].get_lat = NULL;
+        args[i].free_lat = NULL;
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    *ops = 0;
+    for(i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+        *ops += args[i].ops;
+    }
+
+    return now_ns() - t;
+}
+
+// Run worker on 1, 2, 4, ... threads up to the number of online CPUs and
+// report throughput and how it scales relative to a single thread
+static void bench_scaling(void *(*worker)(void *), struct buddy_arena *arena) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    double base = 0, ns, ops_per_sec;
+    long ops;
+    int n;
+
+    if(max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+    if(max_threads < 1) max_threads = 1;
+
+    printf("%8s %14s %8s\n", "threads", "ops/sec", "scaling");
+    for(n = 1; n <= max_threads; n = (n<<1 > max_threads && n < max_threads) ? max_threads : n<<1) {
+        ns = run_threads(n, worker, arena, &ops);
+        ops_per_sec = ops * 1e9 / ns;
+        if(n == 1) base = ops_per_sec;
+        printf("%8d %14.0f %7.2fx\n", n, ops_per_sec, ops_per_sec / base);
+    }
+}
+
+// Each thread allocates a small block and frees it again, over and over,
+// on one arena shared by all threads
+static void *core_worker(void *p) {
+    struct thread_arg *arg = p;
+    int i, ref;
+
+    for(i = 0; i < THREAD_OPS; i++) {
+        ref = buddy_get_mem(arg->arena, 1 + rand_r(&arg->seed) % (4 * BENCH_BLOCK_SIZE));
+        if(ref >= 0) buddy_free_mem(arg->arena, ref);
+        arg->ops += 2;
+    }
+
+    return NULL;
+}
+
+static void bench_core_threads() {
+    struct buddy_arena arena;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    if(buddy_init(&arena, 16, BENCH_BLOCK_SIZE, &bench_locked_hooks, &lock) < 0) {
+        fprintf(stderr, "buddy_init failed\n");
+        exit(1);
+    }
+    arena.policy = use_policy;
+
+    printf("\n-------- thread scaling, one shared arena (depth 16) --------\n");
+    bench_scaling(core_worker, &arena);
+
+    buddy_destroy(&arena);
+}
+
+/// ---------------------------- DEVICE BENCHES ---------------------------- ///
+
+// What the loaded module is running with, filled in by bench_device
+static struct geometry_struct device_geometry;
+
+// Allocate and free n blocks with 2n single ioctls, then with two batched ioctls.
+// With the default geometry the arena only has BUDDY_NUM_BLOCKS blocks, so for
+// large n most requests fail -- each one still costs the same trip into the driver.
+// Load the module with a bigger mem_size to avoid that
+static void bench_batch(int mem) {
+    int sizes[4096];
+    int refs[4096];
+    int rounds, r, i, n;
+    double single_ns, batch_ns, t;
+
+    for(i = 0; i < 4096; i++) {
+        sizes[i] = device_geometry.block_size;
+    }
+
+    printf("%6s %14s %14s %8s\n", "n", "single ns/op", "batch ns/op", "speedup");
+    for(n = 1; n <= 4096; n <<= 1) {
+        rounds = 8192 / n;
+
+        t = now_ns();
+        for(r = 0; r < rounds; r++) {
+            for(i = 0; i < n; i++) refs[i] = get_mem(mem, sizes[i]);
+            for(i = 0; i < n; i++) free_mem(mem, refs[i]);
+        }
+        single_ns = now_ns() - t;
+
+        t = now_ns();
+        for(r = 0; r < rounds; r++) {
+            get_mem_batch(mem, sizes, refs, n);
+            free_mem_batch(mem, refs, NULL, n);
+        }
+        batch_ns = now_ns() - t;
+
+        printf("%6d %14.1f %14.1f %7.1fx\n", n, single_ns / (2.0 * rounds * n),
+            batch_ns / (2.0 * rounds * n), single_ns / batch_ns);
+    }
+}
+
+// Like core_worker, but every thread opens the device for itself
+static void *device_worker(void *p) {
+    struct thread_arg *arg = p;
+    int i, ref, mem;
+    double t;
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    if(mem < 0) {
+        perror("/dev/mem_dev");
+        return NULL;
+    }
+    for(i = 0; i < DEVICE_THREAD_OPS; i++) {
+        t = now_ns();
+        ref = get_mem(mem, 1 + rand_r(&arg->seed) % device_geometry.block_size);
+        if(arg->get_lat) arg->get_lat[i] = now_ns() - t;
+
+        t = now_ns();
+        if(ref >= 0) free_mem(mem, ref);
+        if(arg->free_lat) arg->free_lat[i] = now_ns() - t;
+
+        arg->ops += 2;
+    }
+    close(mem);
+
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report_percentiles(const char *op, double *lat, long n) {
+    qsort(lat, n, sizeof(double), compare_doubles);
+    printf("%-8s p50 %8.0f ns   p99 %8.0f ns   max %8.0f ns\n", op,
+        lat[n / 2], lat[n * 99 / 100], lat[n - 1]);
+}
+
+// Reads one of the module's parameters from sysfs, or "?" if it can't
+static void read_module_param(const char *name, char *value, int size) {
+    char path[256];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/module/buddy_driver/parameters/%s", name);
+    f = fopen(path, "r");
+    if(f == NULL || fgets(value, size, f) == NULL) {
+        snprintf(value, size, "?\n");
+    }
+    if(f) fclose(f);
+    value[strcspn(value, "\n")] = 0;
+}
+
+// Reads one line of the driver's debugfs stats, or "?" if it can't (debugfs
+// is usually only readable by root)
+static void read_driver_stat(const char *name, char *value, int size) {
+    char line[256];
+    int len = strlen(name);
+    FILE *f = fopen("/sys/kernel/debug/buddy/stats", "r");
+
+    snprintf(value, size, "?");
+    while(f && fgets(line, sizeof(line), f)) {
+        if(strncmp(line, name, len) == 0 && line[len] == ' ') {
+            line[strcspn(line, "\n")] = 0;
+            snprintf(value, size, "%s", line + len + strspn(line + len, " "));
+            break;
+        }
+    }
+    if(f) fclose(f);
+}
+
+// Every CPU hammers the device with small get/free pairs.  Reports p50/p99
+// latency of each operation and how often the arena lock was contended
+static void bench_device_latency() {
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[MAX_THREADS];
+    struct thread_arg args[MAX_THREADS];
+    double *get_lat, *free_lat;
+    char magazines[32], before[32], after[32];
+    long n;
+    int i;
+
+    if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    if(nthreads < 1) nthreads = 1;
+    n = (long)nthreads * DEVICE_THREAD_OPS;
+    get_lat = calloc(n, sizeof(double));
+    free_lat = calloc(n, sizeof(double));
+
+    read_module_param("magazines", magazines, sizeof(magazines));
+    read_driver_stat("lock_contended", before, sizeof(before));
+    for(i = 0; i < nthreads; i++) {
+        args[i].arena = NULL;
+        args[i].seed = i + 1;
+        args[i].ops = 0;
+        args[i].get_lat = get_lat + (long)i * DEVICE_THREAD_OPS;
+        args[i].free_lat = free_lat + (long)i * DEVICE_THREAD_OPS;
+        pthread_create(&threads[i], NULL, device_worker, &args[i]);
+    }
+    for(i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    read_driver_stat("lock_contended", after, sizeof(after));
+
+    printf("%d threads, magazines=%s\n", nthreads, magazines);
+    report_percentiles("get_mem", get_lat, n);
+    report_percentiles("free_mem", free_lat, n);
+    if(strcmp(before, "?") == 0 || strcmp(after, "?") == 0) {
+        printf("arena lock contention unknown (can't read /sys/kernel/debug/buddy/stats)\n");
+    } else {
+        printf("arena lock contended %ld times\n", atol(after) - atol(before));
+    }
+
+    free(get_lat);
+    free(free_lat);
+}
+
+// Throughput of copying payloads of 16 B to 64 KB into one block of a private
+// arena: write_mem (which has to find the end of the string first),
+// write_mem_len, and writev_mem with the payload cut into 8 segments
+static void bench_copy() {
+    struct mem_iovec iov[8];
+    char *payload;
+    int mem, ref, len, rounds, r, i, seg;
+    double str_ns, len_ns, vec_ns, t;
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    if(mem < 0) {
+        perror("/dev/mem_dev");
+        return;
+    }
+    ref = -1;
+    if(create_arena(mem, 1<<20, 16) == 0) {
+        ref = get_mem(mem, 1<<16);
+    }
+    if(ref < 0) {
+        fprintf(stderr, "Could not set up a private arena\n");
+        close(mem);
+        return;
+    }
+    payload = malloc((1<<16) + 1);
+    memset(payload, 'x', 1<<16);
+
+    printf("%8s %14s %14s %14s\n", "bytes", "write_mem MB/s", "write_len MB/s", "writev MB/s");
+    for(len = 16; len <= (1<<16); len <<= 2) {
+        rounds = (1<<24) / len;
+        if(rounds > 65536) rounds = 65536;
+        payload[len] = 0;
+
+        t = now_ns();
+        for(r = 0; r < rounds; r++) write_mem(mem, ref, payload);
+        str_ns = now_ns() - t;
+
+        t = now_ns();
+        for(r = 0; r < rounds; r++) write_mem_len(mem, ref, payload, len);
+        len_ns = now_ns() - t;
+
+        seg = len / 8;
+        for(i = 0; i < 8; i++) {
+            iov[i].ref = ref;
+            iov[i].offset = i * seg;
+            iov[i].len = seg;
+            iov[i].buf = payload + i * seg;
+        }
+        t = now_ns();
+        for(r = 0; r < rounds; r++) writev_mem(mem, iov, 8);
+        vec_ns = now_ns() - t;
+
+        payload[len] = 'x';
+        printf("%8d %14.1f %14.1f %14.1f\n", len, 1e3 * len * rounds / str_ns,
+            1e3 * len * rounds / len_ns, 1e3 * len * rounds / vec_ns);
+    }
+
+    free(payload);
+    close(mem);
+}
+
+// Opens the device with a private arena of 1 MB in 16 byte blocks, or -1
+static int open_private() {
+    int mem = open("/dev/mem_dev", O_RDWR);
+
+    if(mem >= 0 && create_arena(mem, 1<<20, 16) < 0) {
+        close(mem);
+        mem = -1;
+    }
+
+    return mem;
+}
+
+#define RING_ROUNDS 4096
+#define RING_BATCH 128 // Commands in flight at once, at most BUDDY_RING_ENTRIES
+
+// Pushes RING_BATCH gets then RING_BATCH frees through the ring, RING_ROUNDS
+// times.  Returns the time taken, or a negative number on error
+static double ring_rounds(int flags) {
+    struct ring_client rc;
+    struct buddy_sqe sqe = { 0 };
+    struct buddy_cqe cqe;
+    int refs[RING_BATCH];
+    int mem, r, i, n;
+    double t;
+
+    mem = open_private();
+    if(mem < 0 || ring_setup(mem, &rc, flags) < 0) {
+        if(mem >= 0) close(mem);
+        return -1;
+    }
+
+    t = now_ns();
+    for(r = 0; r < RING_ROUNDS; r++) {
+        sqe.opcode = BUDDY_OP_GET_MEM;
+        sqe.size = 16;
+        for(i = 0; i < RING_BATCH; i++) {
+            sqe.user_data = i;
+            ring_submit(&rc, &sqe);
+        }
+        ring_enter(&rc);
+        for(n = 0; n < RING_BATCH; ) {
+            if(ring_reap(&rc, &cqe)) {
+                refs[cqe.user_data] = cqe.result;
+                n++;
+            }
+        }
+
+        sqe.opcode = BUDDY_OP_FREE_MEM;
+        for(i = 0; i < RING_BATCH; i++) {
+            sqe.ref = refs[i];
+            ring_submit(&rc, &sqe);
+        }
+        ring_enter(&rc);
+        for(n = 0; n < RING_BATCH; n += ring_reap(&rc, &cqe));
+    }
+    t = now_ns() - t;
+
+    ring_teardown(&rc);
+    close(mem);
+
+    return t;
+}
+
+// Commands per second through single IOCTL_GET_MEM/IOCTL_FREE_MEM calls,
+// through the ring with a doorbell per batch, and through a polled ring
+static void bench_ring() {
+    double ioctl_ns, doorbell_ns, poll_ns, t;
+    double ops = 2.0 * RING_ROUNDS * RING_BATCH;
+    int refs[RING_BATCH];
+    int mem, r, i;
+
+    mem = open_private();
+    if(mem < 0) {
+        fprintf(stderr, "Could not set up a private arena\n");
+        return;
+    }
+    t = now_ns();
+    for(r = 0; r < RING_ROUNDS; r++) {
+        for(i = 0; i < RING_BATCH; i++) refs[i] = get_mem(mem, 16);
+        for(i = 0; i < RING_BATCH; i++) free_mem(mem, refs[i]);
+    }
+    ioctl_ns = now_ns() - t;
+    close(mem);
+
+    doorbell_ns = ring_rounds(0);
+    poll_ns = ring_rounds(BUDDY_RING_POLL);
+
+    printf("%-10s %14s\n", "path", "commands/sec");
+    printf("%-10s %14.0f\n", "ioctl", 1e9 * ops / ioctl_ns);
+    if(doorbell_ns > 0) printf("%-10s %14.0f\n", "doorbell", 1e9 * ops / doorbell_ns);
+    if(poll_ns > 0) printf("%-10s %14.0f\n", "polled", 1e9 * ops / poll_ns);
+}
+
+#define GROW_ROUNDS 2048
+
+// A buffer that starts at 16 bytes and doubles up to 64 KB, over and over:
+// with IOCTL_REALLOC_MEM, and the old way (get_mem a new block, read the
+// data out, write it back, free_mem the old block)
+static void bench_grow() {
+    char *data = malloc(1<<16);
+    int mem, ref, next, size, r;
+    long steps = 0;
+    double realloc_ns, copy_ns, t;
+
+    mem = open_private();
+    if(mem < 0) {
+        fprintf(stderr, "Could not set up a private arena\n");
+        free(data);
+        return;
+    }
+
+    t = now_ns();
+    for(r = 0; r < GROW_ROUNDS; r++) {
+        ref = get_mem(mem, 16);
+        for(size = 32; size <= (1<<16); size <<= 1) {
+            ref = realloc_mem(mem, ref, size);
+        }
+        free_mem(mem, ref);
+    }
+    realloc_ns = now_ns() - t;
+
+    t = now_ns();
+    for(r = 0; r < GROW_ROUNDS; r++) {
+        ref = get_mem(mem, 16);
+        for(size = 32; size <= (1<<16); size <<= 1) {
+            next = get_mem(mem, size);
+            read_mem(mem, ref, data, size / 2);
+            write_mem_len(mem, next, data, size / 2);
+            free_mem(mem, ref);
+            ref = next;
+            steps++;
+        }
+        free_mem(mem, ref);
+    }
+    copy_ns = now_ns() - t;
+
+    printf("%-22s %12s\n", "16 B to 64 KB", "ns/step");
+    printf("%-22s %12.1f\n", "realloc_mem", realloc_ns / steps);
+    printf("%-22s %12.1f\n", "get/read/write/free", copy_ns / steps);
+
+    close(mem);
+    free(data);
+}
+
+static int bench_device() {
+    int mem;
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    if(mem < 0) {
+        perror("/dev/mem_dev");
+        return 1;
+    }
+    if(get_geometry(mem, &device_geometry) < 0) {
+        fprintf(stderr, "Could not get the arena geometry\n");
+        close(mem);
+        return 1;
+    }
+    printf("device arena: %d bytes in blocks of %d\n\n", device_geometry.mem_size, device_geometry.block_size);
+
+    printf("-------- single vs batched ioctls --------\n");
+    bench_batch(mem);
+
+    printf("\n-------- copying into a block --------\n");
+    bench_copy();
+
+    printf("\n-------- growing a buffer --------\n");
+    bench_grow();
+
+    printf("\n-------- ioctls vs submission rings --------\n");
+    bench_ring();
+
+    printf("\n-------- thread scaling, one opener per thread --------\n");
+    bench_scaling(device_worker, NULL);
+
+    printf("\n-------- all-cores latency --------\n");
+    bench_device_latency();
+
+    close(mem);
+    return 0;
+}
+
+/// ------------------------------------------------------------------------ ///
+
+int main(int argc, const char **argv) {
+    int depths[] = {4, 8, 12, 16, 20};
+    unsigned int d;
+    int i;
+
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-f") == 0) {
+            use_policy = BUDDY_FIRST_FIT;
+        } else if(strcmp(argv[i], "-s") == 0) {
+            use_policy = BUDDY_SEGREGATED;
+        } else if(strcmp(argv[i], "-d") == 0) {
+            return bench_device();
+        } else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            return bench_replay(argv[i + 1], i + 2 < argc ? atol(argv[i + 2]) : 0,
+                i + 3 < argc ? atoi(argv[i + 3]) : BENCH_BLOCK_SIZE);
+        }
+    }
+
+    printf("block size %d, %s\n", BENCH_BLOCK_SIZE, policy_names[use_policy]);
+    printf("%5s  %-8s %10s %10s %14s\n", "depth", "workload", "ops", "ns/op", "ops/sec");
+    for(d = 0; d < sizeof(depths)/sizeof(depths[0]); d++) {
+        // First-fit rescans the tree on every allocation, so filling a large
+        // arena is quadratic and would take hours
+        if(use_policy == BUDDY_FIRST_FIT && depths[d] > 12) break;
+        bench_alloc_free(depths[d]);
+        bench_mixed(depths[d]);
+    }
+    bench_core_threads();
+
+    printf("\n-------- eager vs lazy coalescing --------\n");
+    bench_coalescing();
+
+    printf("\n-------- filling the arena: slabs and exact sizes --------\n");
+    bench_fill();
+
+    printf("\n-------- aging, with and without compaction --------\n");
+    bench_aging();
+
+    printf("\n-------- placement policies, one trace replayed --------\n");
+    bench_policies();
+
+    printf("\n-------- emptying a scratch arena --------\n");
+    bench_reset();
+
+    printf("\n-------- restarting from a snapshot vs replaying --------\n");
+    bench_snapshot();
+
+    return 0;
+}
@@ -0,0 +1,1503 @@
+/* Author: Garrett Scholtes
+ * Date:   2015-11-18
+ *
+ * buddy-core.c - The buddy allocator logic, shared by the kernel module
+ * (which #includes this file) and userspace builds (which link it).
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h> // memset
+#else
+#include <string.h>
+#endif
+
+#include "buddy-core.h"
+
+// Trace hooks.  The kernel module defines these as tracepoints before it
+// includes this file.  Everywhere else they compile away to nothing
+#ifndef buddy_trace_get_mem
+#define buddy_trace_get_mem(size, order, ref, visited) do { } while(0)
+#endif
+#ifndef buddy_trace_free_mem
+#define buddy_trace_free_mem(ref, order, ret, visited) do { } while(0)
+#endif
+#ifndef buddy_trace_split
+#define buddy_trace_split(ref, order) do { } while(0)
+#endif
+#ifndef buddy_trace_merge
+#define buddy_trace_merge(ref, order) do { } while(0)
+#endif
+
+// The tree that keeps track of our blocks and how they are fragmented is stored
+// as a flat array indexed heap-style: node 0 is the root and the children of
+// node n are nodes 2n+1 and 2n+2.  It is allocated once in buddy_init, so
+// splitting and merging never have to allocate anything.
+// CACHED blocks are allocated as far as the tree is concerned, but are owned
+// by whoever called buddy_cache_fill (e.g. the driver's per-CPU magazines).
+// An exact allocation is a run of blocks of decreasing size: a RUN block
+// followed by the TAIL blocks that belong to it
+enum block_state {PARENT, ALLOCATED, FREE, CACHED, RUN, TAIL};
+#define LEFT_CHILD(n) (((n)<<1) + 1)
+#define RIGHT_CHILD(n) (((n)<<1) + 2)
+#define PARENT_NODE(n) (((n)-1)>>1)
+// In 1-based heap numbering a node and its buddy differ only in the lowest bit,
+// the same way their offsets differ only in the bit for their block size
+#define BUDDY_NODE(n) ((((n)+1) ^ 1) - 1)
+
+// The order of a block is log2 of its size in units of block_size.
+// Order 0 is the smallest block, order arena->depth is the whole arena
+#define NODE_LEVEL(n) (31 - __builtin_clz((n)+1))
+#define NODE_ORDER(arena, n) ((arena)->depth - NODE_LEVEL(n))
+#define NODE_SIZE(arena, n) ((long)(arena)->block_size << NODE_ORDER(arena, n))
+#define NODE_OFFSET(arena, n) ((long)(((n)+1) - (1<<NODE_LEVEL(n))) * NODE_SIZE(arena, n))
+
+static void __lock(struct buddy_arena *arena) {
+    if(arena->hooks->lock) arena->hooks->lock(arena->lock_data);
+}
+
+static void __unlock(struct buddy_arena *arena) {
+    if(arena->hooks->unlock) arena->hooks->unlock(arena->lock_data);
+}
+
+/// ------------------------------ FREE LISTS ------------------------------ ///
+
+// Every FREE leaf is on the free list for its order.  Any free block can be
+// unlinked in O(1) when its buddy is merged into it.  -1 terminates a list
+
+static void __free_list_push(struct buddy_arena *arena, int block) {
+    int order = NODE_ORDER(arena, block);
+
+    arena->free_prev[block] = -1;
+    arena->free_next[block] = arena->free_head[order];
+    if(arena->free_head[order] >= 0) arena->free_prev[arena->free_head[order]] = block;
+    arena->free_head[order] = block;
+    arena->stats.free_blocks[order]++;
+}
+
+static void __free_list_remove(struct buddy_arena *arena, int block) {
+    arena->stats.free_blocks[NODE_ORDER(arena, block)]--;
+    if(arena->free_prev[block] >= 0) {
+        arena->free_next[arena->free_prev[block]] = arena->free_next[block];
+    } else {
+        arena->free_head[NODE_ORDER(arena, block)] = arena->free_next[block];
+    }
+    if(arena->free_next[block] >= 0) arena->free_prev[arena->free_next[block]] = arena->free_prev[block];
+}
+
+/// ------------------------ BUDDY ALLOCATOR LOGIC ------------------------- ///
+
+// Given a block (already off its free list), splits it into two buddies.
+// The right buddy goes on the free list, the left one is left for the caller
+static void __split_block(struct buddy_arena *arena, int block) {
+    buddy_trace_split(NODE_OFFSET(arena, block), NODE_ORDER(arena, block));
+    arena->tree[block] = PARENT;
+    arena->tree[LEFT_CHILD(block)] = FREE;
+    arena->tree[RIGHT_CHILD(block)] = FREE;
+    __free_list_push(arena, RIGHT_CHILD(block));
+    arena->stats.splits++;
+}
+
+// Given a leaf node, make it free and attempt to merge it with it's buddy
+static void __free_and_merge(struct buddy_arena *arena, int block) {
+    // Merging is just marking the parent free again.  The stale states of the
+    // children are never looked at because lookups stop at the first non-PARENT
+    while(block > 0 && arena->tree[BUDDY_NODE(block)] == FREE) {
+        __free_list_remove(arena, BUDDY_NODE(block));
+        block = PARENT_NODE(block);
+        arena->stats.merges++;
+        buddy_trace_merge(NODE_OFFSET(arena, block), NODE_ORDER(arena, block));
+    }
+    arena->tree[block] = FREE;
+    __free_list_push(arena, block);
+}
+
+// Merges every pair of free buddies, bottom up, so that each order's list
+// feeds the next.  Only needed in lazy mode, where frees don't merge
+static void __coalesce(struct buddy_arena *arena) {
+    int order;
+    int block;
+    int next;
+
+    for(order = 0; order < arena->depth; order++) {
+        for(block = arena->free_head[order]; block >= 0; block = next) {
+            next = arena->free_next[block];
+            if(arena->tree[BUDDY_NODE(block)] != FREE) {
+                continue;
+            }
+            if(next == BUDDY_NODE(block)) {
+                next = arena->free_next[next];
+            }
+            __free_list_remove(arena, block);
+            __free_list_remove(arena, BUDDY_NODE(block));
+            block = PARENT_NODE(block);
+            arena->tree[block] = FREE;
+            __free_list_push(arena, block);
+            arena->stats.merges++;
+            buddy_trace_merge(NODE_OFFSET(arena, block), NODE_ORDER(arena, block));
+        }
+    }
+    arena->lazy_pending = 0;
+    arena->stats.coalesces++;
+}
+
+// Frees a leaf, merging it now or later depending on the mode
+static void __free_block(struct buddy_arena *arena, int block) {
+    if(!arena->lazy_limit) {
+        __free_and_merge(arena, block);
+        return;
+    }
+
+    arena->tree[block] = FREE;
+    __free_list_push(arena, block);
+    if(++arena->lazy_pending >= arena->lazy_limit) {
+        __coalesce(arena);
+    }
+}
+
+static int __get_block_from_address(struct buddy_arena *arena, long ref) {
+    int block_idx;
+    int nth_bit;
+    int n;
+    int current_node;
+
+    if(ref < 0 || arena->mem_size <= ref) return -1;
+
+    // The binary representation of the block index (block_idx) from right to left,
+    // starting at the depth bit, will tell us whether the node we are
+    // looking for is in the right or left half of the tree
+    block_idx = ref / arena->block_size;
+    current_node = 0;
+    for(n = arena->depth-1; n >= 0; n--) {
+        arena->visited++;
+        // If the current node is not a leaf, then we already found our block
+        if(arena->tree[current_node] != PARENT) {
+            break;
+        }
+        nth_bit = (block_idx >> n) & 1;
+        // If 1, go right; else go left
+        if(nth_bit) {
+            current_node = RIGHT_CHILD(current_node);
+        } else {
+            current_node = LEFT_CHILD(current_node);
+        }
+    }
+
+    return current_node;
+}
+
+// Find the lowest-addressed free block of at least the given order (whose
+// offset is a multiple of align) by scanning the left subtree before the
+// right.  Returns -1 if there is none
+static int __first_fit(struct buddy_arena *arena, int order, long align, int block) {
+    int found;
+
+    arena->visited++;
+    if(NODE_ORDER(arena, block) < order) {
+        return -1;
+    }
+    if(arena->tree[block] == FREE) {
+        return NODE_OFFSET(arena, block) % align == 0 ? block : -1;
+    }
+    if(arena->tree[block] != PARENT) {
+        return -1;
+    }
+    found = __first_fit(arena, order, align, LEFT_CHILD(block));
+    if(found >= 0) {
+        return found;
+    }
+    return __first_fit(arena, order, align, RIGHT_CHILD(block));
+}
+
+// The lowest-addressed free block of at least the given order whose offset is
+// a multiple of align and below limit, or -1.  Walks the free lists rather
+// than the tree, so it costs one step per free block instead of one per node
+static int __fit_below(struct buddy_arena *arena, int order, long align, long limit) {
+    int found = -1;
+    int block;
+
+    for(; order <= arena->depth; order++) {
+        for(block = arena->free_head[order]; block >= 0; block = arena->free_next[block]) {
+            arena->visited++;
+            if(NODE_OFFSET(arena, block) < limit && NODE_OFFSET(arena, block) % align == 0) {
+                found = block;
+                limit = NODE_OFFSET(arena, block);
+            }
+        }
+    }
+
+    return found;
+}
+
+// The free block of at least the given order whose offset is a multiple of
+// align and that ends highest in the arena, or -1
+static int __fit_highest(struct buddy_arena *arena, int order, long align) {
+    int found = -1;
+    long end = 0;
+    int block;
+
+    for(; order <= arena->depth; order++) {
+        for(block = arena->free_head[order]; block >= 0; block = arena->free_next[block]) {
+            arena->visited++;
+            if(NODE_OFFSET(arena, block) + NODE_SIZE(arena, block) > end && NODE_OFFSET(arena, block) % align == 0) {
+                found = block;
+                end = NODE_OFFSET(arena, block) + NODE_SIZE(arena, block);
+            }
+        }
+    }
+
+    return found;
+}
+
+// Smallest order whose blocks can hold size bytes, or -1 if even the whole
+// arena is too small
+static int __size_to_order(struct buddy_arena *arena, long size) {
+    int order;
+
+    if(size > arena->mem_size) {
+        return -1;
+    }
+    order = 0;
+    while(((long)arena->block_size << order) < size) {
+        order++;
+    }
+
+    return order;
+}
+
+static int __slab_reclaim(struct buddy_arena *arena);
+
+// How far down a free list to look for a block that happens to be aligned
+// before settling for a bigger block, which always is
+#define ALIGN_SCAN 32
+
+// Take a free block of exactly the given order whose offset is a multiple of
+// align out of the tree, splitting a bigger one if needed, and mark it with
+// state.  Where it comes from is up to the arena's policy.  Returns its node or -1
+static int __alloc_aligned(struct buddy_arena *arena, int order, long align, int state) {
+    bool from_top = false;
+    int block;
+    int o;
+    int n;
+
+    if(arena->policy == BUDDY_FIRST_FIT) {
+        block = __first_fit(arena, order, align, 0);
+    } else if(arena->policy == BUDDY_SEGREGATED) {
+        from_top = order >= arena->large_order;
+        block = from_top ? __fit_highest(arena, order, align) : __fit_below(arena, order, align, arena->mem_size);
+    } else {
+        // Pop from the smallest list that is big enough and has an aligned
+        // block.  Every block is aligned to its own size, so once the blocks
+        // are as big as align the head of the list will do
+        block = -1;
+        for(o = order; o <= arena->depth && block < 0; o++) {
+            arena->visited++;
+            for(block = arena->free_head[o], n = 0; block >= 0; block = arena->free_next[block], n++) {
+                if(NODE_OFFSET(arena, block) % align == 0) {
+                    break;
+                }
+                if(n == ALIGN_SCAN) {
+                    block = -1;
+                    break;
+                }
+            }
+        }
+    }
+    // The space may only be missing because frees haven't been merged yet
+    if(block < 0 && arena->lazy_pending > 0) {
+        __coalesce(arena);
+        return __alloc_aligned(arena, order, align, state);
+    }
+    // ... or because empty slabs are being kept around
+    if(block < 0 && __slab_reclaim(arena) > 0) {
+        return __alloc_aligned(arena, order, align, state);
+    }
+    if(block < 0) {
+        return -1;
+    }
+
+    // The block is too big, so keep splitting it into buddies and taking the
+    // left half (which starts where the block does) until it is the proper size.
+    // A block that belongs at the top takes the right half instead, as long as
+    // that is still aligned
+    __free_list_remove(arena, block);
+    while(NODE_ORDER(arena, block) > order) {
+        __split_block(arena, block);
+        if(from_top && NODE_SIZE(arena, RIGHT_CHILD(block)) % align == 0) {
+            __free_list_remove(arena, RIGHT_CHILD(block));
+            __free_list_push(arena, LEFT_CHILD(block));
+            block = RIGHT_CHILD(block);
+        } else {
+            block = LEFT_CHILD(block);
+        }
+        arena->visited++;
+    }
+    arena->tree[block] = state;
+
+    return block;
+}
+
+static int __alloc_block(struct buddy_arena *arena, int order, int state) {
+    return __alloc_aligned(arena, order, 1, state);
+}
+
+// Allocates the smallest run of minimum blocks that holds size bytes.  The
+// block of the rounded-up order is split down along the end of the run, and
+// every buddy past the end goes back on the free lists.  Returns the run's ref or -1
+static long __get_mem_exact(struct buddy_arena *arena, long size) {
+    int order;
+    int block;
+    int blocks;
+    int half;
+    int state = RUN;
+    long ref = -1;
+
+    arena->visited = 0;
+
+    order = __size_to_order(arena, size);
+    block = order >= 0 ? __alloc_block(arena, order, ALLOCATED) : -1;
+    if(block >= 0) {
+        ref = NODE_OFFSET(arena, block);
+
+        // Number of minimum blocks still to cover, starting at block
+        blocks = size > arena->block_size ? (size - 1) / arena->block_size + 1 : 1;
+        while(blocks < (1 << NODE_ORDER(arena, block))) {
+            half = 1 << (NODE_ORDER(arena, block) - 1);
+            __split_block(arena, block);
+            if(blocks < half) {
+                // Only the left half is needed, the right one stays on its free list
+                block = LEFT_CHILD(block);
+            } else {
+                // All of the left half is needed and the rest comes out of the right
+                arena->tree[LEFT_CHILD(block)] = state;
+                state = TAIL;
+                blocks -= half;
+                if(blocks == 0) {
+                    break;
+                }
+                block = RIGHT_CHILD(block);
+                __free_list_remove(arena, block);
+            }
+            arena->visited++;
+        }
+        // A run of one block is just an ordinary block
+        if(blocks > 0) {
+            arena->tree[block] = state == RUN ? ALLOCATED : state;
+        }
+    }
+    buddy_trace_get_mem(size, order, ref, arena->visited);
+
+    return ref;
+}
+
+// Gives the offset and size of the whole run that block (a RUN or TAIL block) belongs to
+static void __run_bounds(struct buddy_arena *arena, int block, long *start, long *size) {
+    long end;
+
+    while(arena->tree[block] == TAIL) {
+        block = __get_block_from_address(arena, NODE_OFFSET(arena, block) - 1);
+    }
+    *start = NODE_OFFSET(arena, block);
+    end = *start + NODE_SIZE(arena, block);
+    while(end < arena->mem_size) {
+        block = __get_block_from_address(arena, end);
+        if(arena->tree[block] != TAIL) {
+            break;
+        }
+        end += NODE_SIZE(arena, block);
+    }
+    *size = end - *start;
+}
+
+// Frees a run, starting at its RUN block
+static void __free_run(struct buddy_arena *arena, int block) {
+    long next;
+
+    do {
+        next = NODE_OFFSET(arena, block) + NODE_SIZE(arena, block);
+        __free_block(arena, block);
+        block = next < arena->mem_size ? __get_block_from_address(arena, next) : -1;
+    } while(block >= 0 && arena->tree[block] == TAIL);
+}
+
+// Whether block could grow to the given order in place: it has to be the left
+// buddy all the way up, with every buddy on the way completely free
+static bool __can_grow(struct buddy_arena *arena, int block, int order) {
+    for(; NODE_ORDER(arena, block) < order; block = PARENT_NODE(block)) {
+        arena->visited++;
+        if(block != LEFT_CHILD(PARENT_NODE(block)) || arena->tree[BUDDY_NODE(block)] != FREE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Resizes the plain block at block to the given order without moving it.
+// Growing merges it with its free buddies, shrinking splits off the upper
+// halves.  0 on success, 1 if it would have to move
+static int __resize_block(struct buddy_arena *arena, int block, int order) {
+    if(order > NODE_ORDER(arena, block)) {
+        // Free buddies may only be scattered because frees weren't merged yet
+        if(!__can_grow(arena, block, order) && arena->lazy_pending > 0) {
+            __coalesce(arena);
+        }
+        if(!__can_grow(arena, block, order)) {
+            return 1;
+        }
+        while(NODE_ORDER(arena, block) < order) {
+            __free_list_remove(arena, BUDDY_NODE(block));
+            block = PARENT_NODE(block);
+            arena->stats.merges++;
+            buddy_trace_merge(NODE_OFFSET(arena, block), NODE_ORDER(arena, block));
+        }
+    }
+    while(order < NODE_ORDER(arena, block)) {
+        __split_block(arena, block);
+        block = LEFT_CHILD(block);
+    }
+    arena->tree[block] = ALLOCATED;
+
+    return 0;
+}
+
+/// ----------------------------- SIZE CLASSES ----------------------------- ///
+
+// A slab is a buddy block of order slab_order carved into equal objects of
+// one size class, with a bitmap of the free ones.  Buddy blocks are aligned
+// to their size, so the slab a ref falls in is simply ref / SLAB_SIZE
+
+#define SLAB_BYTES 4096 // Preferred slab size, smaller arenas get smaller slabs
+#define SLAB_MAX_OBJS 512
+
+static const int slab_classes[BUDDY_SLAB_CLASSES] = {8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+
+struct buddy_slab {
+    // Size class, or -1 if this stretch of the arena is not a slab.  Only
+    // good if gen is the arena's generation: buddy_reset leaves the table be
+    int cls;
+    unsigned int gen;
+    int free_count;
+
+    // Links in the class's list of slabs with free objects, by slab index
+    int next;
+    int prev;
+
+    // Set bits are free objects
+    unsigned long long map[SLAB_MAX_OBJS / 64];
+};
+
+#define SLAB_SIZE(arena) ((long)(arena)->block_size << (arena)->slab_order)
+#define SLAB_OBJS(arena, cls) (SLAB_SIZE(arena) / slab_classes[cls])
+
+// The size class that serves size bytes, or -1 if the buddy block size would
+// round up to is no bigger than the class anyway
+static int __slab_class(struct buddy_arena *arena, long size) {
+    int order = __size_to_order(arena, size);
+    int cls;
+
+    if(!arena->slabs || order < 0) {
+        return -1;
+    }
+    for(cls = 0; cls < BUDDY_SLAB_CLASSES; cls++) {
+        if(slab_classes[cls] < size || SLAB_MAX_OBJS < SLAB_OBJS(arena, cls)) {
+            continue;
+        }
+        if(slab_classes[cls] < ((long)arena->block_size << order) && SLAB_OBJS(arena, cls) >= 2) {
+            return cls;
+        }
+        return -1;
+    }
+
+    return -1;
+}
+
+// The slab ref lies in, or NULL
+static struct buddy_slab *__slab_of(struct buddy_arena *arena, long ref) {
+    struct buddy_slab *slab;
+
+    if(!arena->slabs || ref < 0 || arena->mem_size <= ref) {
+        return NULL;
+    }
+    slab = &arena->slabs[ref / SLAB_SIZE(arena)];
+
+    return slab->cls >= 0 && slab->gen == arena->generation ? slab : NULL;
+}
+
+static void __slab_list_push(struct buddy_arena *arena, int idx) {
+    struct buddy_slab *slab = &arena->slabs[idx];
+    int *head = &arena->slab_partial[slab->cls];
+
+    slab->prev = -1;
+    slab->next = *head;
+    if(*head >= 0) arena->slabs[*head].prev = idx;
+    *head = idx;
+}
+
+static void __slab_list_remove(struct buddy_arena *arena, int idx) {
+    struct buddy_slab *slab = &arena->slabs[idx];
+
+    if(slab->prev >= 0) {
+        arena->slabs[slab->prev].next = slab->next;
+    } else {
+        arena->slab_partial[slab->cls] = slab->next;
+    }
+    if(slab->next >= 0) arena->slabs[slab->next].prev = slab->prev;
+}
+
+// Hands out an object of the given class, carving a new slab if every slab
+// of the class is full.  Returns its ref or -1
+static long __slab_alloc(struct buddy_arena *arena, int cls) {
+    struct buddy_slab *slab;
+    int idx = arena->slab_partial[cls];
+    int block;
+    int word;
+    int bit;
+
+    if(idx < 0) {
+        block = __alloc_block(arena, arena->slab_order, ALLOCATED);
+        if(block < 0) {
+            return -1;
+        }
+        idx = NODE_OFFSET(arena, block) / SLAB_SIZE(arena);
+        slab = &arena->slabs[idx];
+        slab->cls = cls;
+        slab->gen = arena->generation;
+        slab->free_count = SLAB_OBJS(arena, cls);
+        memset(slab->map, 0, sizeof(slab->map));
+        for(bit = 0; bit < slab->free_count; bit++) {
+            slab->map[bit / 64] |= 1ULL << (bit % 64);
+        }
+        __slab_list_push(arena, idx);
+        arena->stats.slabs++;
+    }
+
+    slab = &arena->slabs[idx];
+    for(word = 0; slab->map[word] == 0; word++);
+    bit = __builtin_ctzll(slab->map[word]);
+    slab->map[word] &= ~(1ULL << bit);
+    if(--slab->free_count == 0) {
+        __slab_list_remove(arena, idx);
+    }
+    arena->stats.slab_objects++;
+
+    return idx * SLAB_SIZE(arena) + (word * 64 + bit) * slab_classes[cls];
+}
+
+// Gives the empty slab idx back to the tree
+static void __slab_release(struct buddy_arena *arena, int idx) {
+    __slab_list_remove(arena, idx);
+    arena->slabs[idx].cls = -1;
+    arena->stats.slabs--;
+    __free_block(arena, __get_block_from_address(arena, idx * SLAB_SIZE(arena)));
+}
+
+// Index of the live object that starts at ref, which lies in slab, or -1
+static int __slab_object(struct buddy_arena *arena, struct buddy_slab *slab, long ref) {
+    long offset = ref - (slab - arena->slabs) * SLAB_SIZE(arena);
+    int obj = offset / slab_classes[slab->cls];
+
+    if(offset % slab_classes[slab->cls] || SLAB_OBJS(arena, slab->cls) <= obj) {
+        return -1;
+    }
+    if(slab->map[obj / 64] & (1ULL << (obj % 64))) {
+        return -1;
+    }
+
+    return obj;
+}
+
+// Frees the object at ref, which lies in slab.  An empty slab goes back to
+// the tree unless it is the last one of its class with free objects, so that
+// a single object coming and going doesn't carve a slab every time.  Those
+// are reclaimed when a request can't be met otherwise.
+// 0 on success, -1 if ref is not the start of a live object
+static int __slab_free(struct buddy_arena *arena, struct buddy_slab *slab, long ref) {
+    int idx = slab - arena->slabs;
+    int obj = __slab_object(arena, slab, ref);
+
+    if(obj < 0) {
+        return -1;
+    }
+
+    slab->map[obj / 64] |= 1ULL << (obj % 64);
+    if(slab->free_count++ == 0) {
+        __slab_list_push(arena, idx);
+    }
+    arena->stats.slab_objects--;
+
+    if(slab->free_count == SLAB_OBJS(arena, slab->cls) &&
+       (arena->slab_partial[slab->cls] != idx || slab->next >= 0)) {
+        __slab_release(arena, idx);
+    }
+
+    return 0;
+}
+
+// Gives every empty slab back to the tree.  Returns how many there were
+static int __slab_reclaim(struct buddy_arena *arena) {
+    struct buddy_slab *slab;
+    int reclaimed = 0;
+    int cls;
+    int idx;
+    int next;
+
+    if(!arena->slabs) {
+        return 0;
+    }
+    for(cls = 0; cls < BUDDY_SLAB_CLASSES; cls++) {
+        for(idx = arena->slab_partial[cls]; idx >= 0; idx = next) {
+            slab = &arena->slabs[idx];
+            next = slab->next;
+            if(slab->free_count == SLAB_OBJS(arena, cls)) {
+                __slab_release(arena, idx);
+                reclaimed++;
+            }
+        }
+    }
+
+    return reclaimed;
+}
+
+/// ------------------------------------------------------------------------ ///
+
+// Allocates size bytes at an offset that is a multiple of align (a power of two)
+static long __get_mem(struct buddy_arena *arena, long size, long align) {
+    int order;
+    int block;
+    int cls;
+    long ref = -1;
+
+    arena->visited = 0;
+
+    // Small requests come out of a slab if they can.  Objects are aligned to
+    // the lowest set bit of their size
+    cls = __slab_class(arena, size);
+    if(cls >= 0 && (slab_classes[cls] & -slab_classes[cls]) >= align) {
+        ref = __slab_alloc(arena, cls);
+    }
+
+    // Case: user has requested more memory than is available
+    order = __size_to_order(arena, size);
+    if(ref < 0 && order >= 0) {
+        block = __alloc_aligned(arena, order, align, ALLOCATED);
+        if(block >= 0) {
+            ref = NODE_OFFSET(arena, block);
+        }
+    }
+    buddy_trace_get_mem(size, order, ref, arena->visited);
+
+    return ref;
+}
+
+static int __resize(struct buddy_arena *arena, long ref, long size) {
+    struct buddy_slab *slab;
+    int block;
+    int order;
+    long start;
+    long run_size;
+
+    arena->visited = 0;
+
+    // An object stays where it is for as long as the new size fits its class
+    slab = __slab_of(arena, ref);
+    if(slab) {
+        if(__slab_object(arena, slab, ref) < 0) {
+            return -1;
+        }
+        return size <= slab_classes[slab->cls] ? 0 : 1;
+    }
+
+    block = __get_block_from_address(arena, ref);
+    if(block < 0 || NODE_OFFSET(arena, block) != ref) {
+        return -1;
+    }
+    switch(arena->tree[block]) {
+    case ALLOCATED:
+        order = __size_to_order(arena, size);
+        return order < 0 ? 1 : __resize_block(arena, block, order);
+    case RUN:
+        // So does a run
+        __run_bounds(arena, block, &start, &run_size);
+        return size <= run_size ? 0 : 1;
+    case CACHED:
+        // Owned by whoever called buddy_cache_fill, which has to do any moving
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static int __free_mem(struct buddy_arena *arena, long ref) {
+    struct buddy_slab *slab;
+    int block;
+
+    arena->visited = 0;
+
+    slab = __slab_of(arena, ref);
+    if(slab) {
+        return __slab_free(arena, slab, ref);
+    }
+    block = __get_block_from_address(arena, ref);
+
+    if(block < 0 || (arena->tree[block] != ALLOCATED && arena->tree[block] != RUN)) {
+        buddy_trace_free_mem(ref, block < 0 ? -1 : NODE_ORDER(arena, block), -1, arena->visited);
+        return -1;
+    }
+
+    buddy_trace_free_mem(ref, NODE_ORDER(arena, block), 0, arena->visited);
+    if(arena->tree[block] == RUN) {
+        __free_run(arena, block);
+    } else {
+        __free_block(arena, block);
+    }
+
+    return 0;
+}
+
+/// ------------------------------- HANDLES -------------------------------- ///
+
+// A free handle table entry stores the next free handle (-1 ends the list)
+// as -2 minus it, so that every free entry is negative
+#define HANDLE_LINK(next) (-2 - (next))
+
+static int __get_handle(struct buddy_arena *arena, long size) {
+    int handle;
+    int order;
+    int block;
+
+    // There is a handle for every minimum block, so running out of handles
+    // means running out of blocks first
+    order = __size_to_order(arena, size);
+    block = order >= 0 ? __alloc_block(arena, order, ALLOCATED) : -1;
+    if(block < 0) {
+        return -1;
+    }
+    // Freed handles first, then ones that were never used
+    if(arena->handle_free >= 0) {
+        handle = arena->handle_free;
+        arena->handle_free = HANDLE_LINK(arena->handle_refs[handle]);
+    } else {
+        handle = arena->handles_used++;
+    }
+    arena->handle_refs[handle] = NODE_OFFSET(arena, block);
+
+    return handle;
+}
+
+static int __free_handle(struct buddy_arena *arena, int handle) {
+    if(handle < 0 || arena->handles_used <= handle || arena->handle_refs[handle] < 0) {
+        return -1;
+    }
+    if(__free_mem(arena, arena->handle_refs[handle]) < 0) {
+        return -1;
+    }
+    arena->handle_refs[handle] = HANDLE_LINK(arena->handle_free);
+    arena->handle_free = handle;
+
+    return 0;
+}
+
+// Moves the block behind handle to the lowest-addressed free block that can
+// hold it, if that is below it.  Returns 1 if it moved, 0 if not
+static int __compact_one(struct buddy_arena *arena, int handle,
+                         void (*move)(void *ctx, long dst, long src, long size), void *ctx) {
+    long ref = arena->handle_refs[handle];
+    int block;
+    int target;
+
+    block = __get_block_from_address(arena, ref);
+    target = __fit_below(arena, NODE_ORDER(arena, block), 1, ref);
+    if(target < 0) {
+        return 0;
+    }
+
+    __free_list_remove(arena, target);
+    while(NODE_ORDER(arena, target) > NODE_ORDER(arena, block)) {
+        __split_block(arena, target);
+        target = LEFT_CHILD(target);
+    }
+    arena->tree[target] = ALLOCATED;
+
+    move(ctx, NODE_OFFSET(arena, target), ref, NODE_SIZE(arena, block));
+    arena->handle_refs[handle] = NODE_OFFSET(arena, target);
+    __free_block(arena, block);
+    arena->stats.moves++;
+
+    return 1;
+}
+
+/// ------------------------------ SNAPSHOTS ------------------------------- ///
+
+#define SNAPSHOT_PAD(n) (((n) + 7) & ~7LL)
+
+// Works out where each section of a snapshot with header hdr goes.  Returns
+// its data_offset, or -1 if the header is not one this core could have written
+static long long __snapshot_layout(const struct buddy_snapshot *hdr, long long *slabs_at, long long *handles_at) {
+    long long at;
+
+    if(hdr->magic != BUDDY_SNAPSHOT_MAGIC || hdr->version != BUDDY_SNAPSHOT_VERSION) {
+        return -1;
+    }
+    if(hdr->depth < 0 || BUDDY_MAX_DEPTH < hdr->depth || hdr->block_size <= 0 ||
+       (hdr->block_size & (hdr->block_size-1)) || (long long)hdr->block_size << hdr->depth != hdr->mem_size) {
+        return -1;
+    }
+    if(hdr->slab_order < -1 || hdr->depth < hdr->slab_order ||
+       hdr->handles_used < -1 || (1LL << hdr->depth) < hdr->handles_used) {
+        return -1;
+    }
+
+    at = SNAPSHOT_PAD(sizeof(struct buddy_snapshot));
+    at += SNAPSHOT_PAD((2LL << hdr->depth) - 1);
+    *slabs_at = at;
+    if(hdr->slab_order >= 0) {
+        at += SNAPSHOT_PAD((1LL << (hdr->depth - hdr->slab_order)) * sizeof(struct buddy_slab));
+    }
+    *handles_at = at;
+    if(hdr->handles_used >= 0) {
+        at += SNAPSHOT_PAD((1LL << hdr->depth) * sizeof(long));
+    }
+
+    return (at + BUDDY_SNAPSHOT_ALIGN - 1) / BUDDY_SNAPSHOT_ALIGN * BUDDY_SNAPSHOT_ALIGN;
+}
+
+static void __snapshot_header(struct buddy_arena *arena, struct buddy_snapshot *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = BUDDY_SNAPSHOT_MAGIC;
+    hdr->version = BUDDY_SNAPSHOT_VERSION;
+    hdr->mem_size = arena->mem_size;
+    hdr->block_size = arena->block_size;
+    hdr->depth = arena->depth;
+    hdr->policy = arena->policy;
+    hdr->large_order = arena->large_order;
+    hdr->lazy_limit = arena->lazy_limit;
+    hdr->lazy_pending = arena->lazy_pending;
+    hdr->slab_order = arena->slabs ? arena->slab_order : -1;
+    hdr->handles_used = arena->handle_refs ? arena->handles_used : -1;
+    hdr->handle_free = arena->handle_free;
+}
+
+// Puts every FREE leaf under block back on its free list, right to left so
+// that each list ends up in address order.  On the way it checks that runs are
+// whole: *tails is set by a TAIL and has to be cleared by the RUN that starts
+// it (__run_bounds walks back through TAILs until it finds one).  Returns -1
+// if the tree under block is not one the core could have built
+static int __rebuild_free_lists(struct buddy_arena *arena, int block, bool *tails) {
+    switch(arena->tree[block]) {
+    case PARENT:
+        if(NODE_ORDER(arena, block) == 0) {
+            return -1;
+        }
+        if(__rebuild_free_lists(arena, RIGHT_CHILD(block), tails) < 0) {
+            return -1;
+        }
+        return __rebuild_free_lists(arena, LEFT_CHILD(block), tails);
+    case TAIL:
+        *tails = true;
+        return 0;
+    case RUN:
+        // A run of one block would have been ALLOCATED
+        if(!*tails) {
+            return -1;
+        }
+        *tails = false;
+        return 0;
+    case FREE:
+        if(*tails) {
+            return -1;
+        }
+        __free_list_push(arena, block);
+        return 0;
+    case ALLOCATED:
+        return *tails ? -1 : 0;
+    default:
+        return -1;
+    }
+}
+
+// Checks the handle table copied from a snapshot against the tree: every live
+// handle has to name the start of its own ALLOCATED block (which is all
+// __get_handle hands out), and the free handles have to form one list that
+// ends.  Returns -1 if they don't
+static int __check_handles(struct buddy_arena *arena) {
+    long ref;
+    int num_free = 0;
+    int block;
+    int n;
+
+    if(arena->handle_free < -1 || arena->handles_used <= arena->handle_free) {
+        return -1;
+    }
+    // An ALLOCATED block is on no free list, so its free_next link is free
+    // to mark which handle claimed it
+    for(n = 0; n < arena->handles_used; n++) {
+        ref = arena->handle_refs[n];
+        if(ref < 0) {
+            if(arena->handles_used <= HANDLE_LINK(ref)) {
+                return -1;
+            }
+            num_free++;
+            continue;
+        }
+        block = __get_block_from_address(arena, ref);
+        if(block < 0 || NODE_OFFSET(arena, block) != ref || arena->tree[block] != ALLOCATED ||
+           __slab_of(arena, ref)) {
+            return -1;
+        }
+        arena->free_next[block] = -1;
+    }
+    for(n = 0; n < arena->handles_used; n++) {
+        if(arena->handle_refs[n] < 0) {
+            continue;
+        }
+        block = __get_block_from_address(arena, arena->handle_refs[n]);
+        if(arena->free_next[block] != -1) {
+            return -1;
+        }
+        arena->free_next[block] = n;
+    }
+
+    // Every step has to land on a free entry, so a list that is still going
+    // after num_free steps has a cycle in it
+    for(n = arena->handle_free; n >= 0 && num_free > 0; num_free--) {
+        if(arena->handle_refs[n] >= 0) {
+            return -1;
+        }
+        n = HANDLE_LINK(arena->handle_refs[n]);
+    }
+
+    return n == -1 ? 0 : -1;
+}
+
+// Relinks the slabs copied from a snapshot and recounts them.  Returns -1 if
+// an entry makes no sense
+static int __rebuild_slabs(struct buddy_arena *arena) {
+    struct buddy_slab *slab;
+    int num_slabs = arena->mem_size / SLAB_SIZE(arena);
+    int free_count;
+    int block;
+    int objs;
+    int word;
+    int idx;
+
+    for(idx = 0; idx < num_slabs; idx++) {
+        slab = &arena->slabs[idx];
+        slab->gen = 0;
+        if(slab->cls < 0) {
+            slab->cls = -1;
+            continue;
+        }
+        // A slab is an ALLOCATED block of slab_order, which it gives back to
+        // the tree once it is empty
+        block = __get_block_from_address(arena, idx * SLAB_SIZE(arena));
+        if(BUDDY_SLAB_CLASSES <= slab->cls || arena->tree[block] != ALLOCATED ||
+           NODE_ORDER(arena, block) != arena->slab_order) {
+            return -1;
+        }
+        // The bitmap is what allocations trust, so it has to agree with the
+        // count and mark nothing past the end of the slab
+        for(word = 0, free_count = 0; word < SLAB_MAX_OBJS / 64; word++) {
+            objs = SLAB_OBJS(arena, slab->cls) - word * 64;
+            if(objs < 64 && (slab->map[word] >> (objs < 0 ? 0 : objs))) {
+                return -1;
+            }
+            free_count += __builtin_popcountll(slab->map[word]);
+        }
+        if(free_count != slab->free_count) {
+            return -1;
+        }
+        if(slab->free_count > 0) {
+            __slab_list_push(arena, idx);
+        }
+        arena->stats.slabs++;
+        arena->stats.slab_objects += SLAB_OBJS(arena, slab->cls) - slab->free_count;
+    }
+
+    return 0;
+}
+
+/// ------------------------------ PUBLIC API ------------------------------ ///
+
+int buddy_init(struct buddy_arena *arena, int depth, int block_size,
+               const struct buddy_hooks *hooks, void *lock_data) {
+    int num_nodes;
+    int n;
+
+    if(depth < 0 || BUDDY_MAX_DEPTH < depth || block_size <= 0 || (block_size & (block_size-1))) {
+        return -1;
+    }
+
+    memset(arena, 0, sizeof(*arena));
+    arena->depth = depth;
+    arena->block_size = block_size;
+    arena->mem_size = (long)block_size << depth;
+    arena->large_order = (depth + 1) / 2;
+    arena->hooks = hooks;
+    arena->lock_data = lock_data;
+
+    // The whole tree is allocated up front.  Only the root has to start out FREE,
+    // every other node gets its state when its parent is split
+    num_nodes = ((1<<depth) - 1)*2 + 1;
+    arena->tree = hooks->alloc(num_nodes);
+    arena->free_next = hooks->alloc(num_nodes * sizeof(int));
+    arena->free_prev = hooks->alloc(num_nodes * sizeof(int));
+    if(!arena->tree || !arena->free_next || !arena->free_prev) {
+        buddy_destroy(arena);
+        return -1;
+    }
+    memset(arena->tree, FREE, num_nodes);
+
+    for(n = 0; n <= BUDDY_MAX_DEPTH; n++) {
+        arena->free_head[n] = -1;
+    }
+    __free_list_push(arena, 0);
+
+    return 0;
+}
+
+int buddy_enable_slabs(struct buddy_arena *arena) {
+    int num_slabs;
+    int n;
+
+    // Slabs of SLAB_BYTES, but at most a quarter of the arena and at least a block
+    arena->slab_order = 0;
+    while((arena->block_size << arena->slab_order) < SLAB_BYTES && arena->slab_order + 2 < arena->depth) {
+        arena->slab_order++;
+    }
+
+    num_slabs = arena->mem_size / SLAB_SIZE(arena);
+    arena->slabs = arena->hooks->alloc(num_slabs * sizeof(struct buddy_slab));
+    if(!arena->slabs) {
+        return -1;
+    }
+    for(n = 0; n < num_slabs; n++) {
+        arena->slabs[n].cls = -1;
+    }
+    for(n = 0; n < BUDDY_SLAB_CLASSES; n++) {
+        arena->slab_partial[n] = -1;
+    }
+
+    return 0;
+}
+
+int buddy_enable_handles(struct buddy_arena *arena) {
+    arena->max_handles = 1 << arena->depth;
+    arena->handle_refs = arena->hooks->alloc(arena->max_handles * sizeof(long));
+    if(!arena->handle_refs) {
+        return -1;
+    }
+    arena->handles_used = 0;
+    arena->handle_free = -1;
+    arena->compact_cursor = 0;
+
+    return 0;
+}
+
+long buddy_snapshot_size(struct buddy_arena *arena) {
+    struct buddy_snapshot hdr;
+    long long slabs_at;
+    long long handles_at;
+
+    __snapshot_header(arena, &hdr);
+
+    return __snapshot_layout(&hdr, &slabs_at, &handles_at);
+}
+
+long buddy_snapshot(struct buddy_arena *arena, void *buf, long size) {
+    struct buddy_snapshot header;
+    struct buddy_snapshot *hdr = buf;
+    struct buddy_slab *slab;
+    unsigned char *tree;
+    long long slabs_at;
+    long long handles_at;
+    long long data_offset;
+    int num_nodes = ((1<<arena->depth) - 1)*2 + 1;
+    int n;
+
+    // Nothing goes into buf until it is known to be big enough
+    __lock(arena);
+    __snapshot_header(arena, &header);
+    data_offset = __snapshot_layout(&header, &slabs_at, &handles_at);
+    if(size < data_offset) {
+        __unlock(arena);
+        return -1;
+    }
+    header.data_offset = data_offset;
+    header.size = data_offset + arena->mem_size;
+    memcpy(hdr, &header, sizeof(header));
+
+    tree = (unsigned char *)buf + SNAPSHOT_PAD(sizeof(*hdr));
+    memcpy(tree, arena->tree, num_nodes);
+    for(n = 0; n < num_nodes; n++) {
+        if(tree[n] == CACHED) tree[n] = ALLOCATED;
+    }
+    if(arena->slabs) {
+        slab = (struct buddy_slab *)((char *)buf + slabs_at);
+        memcpy(slab, arena->slabs, (arena->mem_size / SLAB_SIZE(arena)) * sizeof(struct buddy_slab));
+        // Entries left over from before a buddy_reset are not slabs
+        for(n = 0; n < arena->mem_size / SLAB_SIZE(arena); n++) {
+            if(slab[n].gen != arena->generation) slab[n].cls = -1;
+        }
+    }
+    if(arena->handle_refs) {
+        memcpy((char *)buf + handles_at, arena->handle_refs, arena->max_handles * sizeof(long));
+    }
+    __unlock(arena);
+
+    return data_offset;
+}
+
+long buddy_snapshot_check(const struct buddy_snapshot *hdr) {
+    long long slabs_at;
+    long long handles_at;
+
+    return __snapshot_layout(hdr, &slabs_at, &handles_at);
+}
+
+int buddy_restore(struct buddy_arena *arena, const void *snap, long size,
+                  const struct buddy_hooks *hooks, void *lock_data) {
+    const struct buddy_snapshot *hdr = snap;
+    long long slabs_at;
+    long long handles_at;
+    bool tails = false;
+
+    if(size < (long)sizeof(*hdr) || __snapshot_layout(hdr, &slabs_at, &handles_at) != hdr->data_offset ||
+       size < hdr->data_offset || hdr->policy < BUDDY_BEST_FIT || BUDDY_SEGREGATED < hdr->policy ||
+       hdr->lazy_limit < 0 || hdr->lazy_pending < 0) {
+        return -1;
+    }
+    if(buddy_init(arena, hdr->depth, hdr->block_size, hooks, lock_data) < 0) {
+        return -1;
+    }
+    arena->policy = hdr->policy;
+    arena->large_order = hdr->large_order;
+    arena->lazy_limit = hdr->lazy_limit;
+    arena->lazy_pending = hdr->lazy_pending;
+
+    // buddy_init put the root on its free list, which the tree now decides
+    memcpy(arena->tree, (const char *)snap + SNAPSHOT_PAD(sizeof(*hdr)), ((1<<hdr->depth) - 1)*2 + 1);
+    arena->free_head[arena->depth] = -1;
+    arena->stats.free_blocks[arena->depth] = 0;
+    if(__rebuild_free_lists(arena, 0, &tails) < 0 || tails) {
+        goto fail;
+    }
+
+    if(hdr->slab_order >= 0) {
+        if(buddy_enable_slabs(arena) < 0 || arena->slab_order != hdr->slab_order) {
+            goto fail;
+        }
+        memcpy(arena->slabs, (const char *)snap + slabs_at,
+               (arena->mem_size / SLAB_SIZE(arena)) * sizeof(struct buddy_slab));
+        if(__rebuild_slabs(arena) < 0) {
+            goto fail;
+        }
+    }
+
+    if(hdr->handles_used >= 0) {
+        if(buddy_enable_handles(arena) < 0) {
+            goto fail;
+        }
+        memcpy(arena->handle_refs, (const char *)snap + handles_at, arena->max_handles * sizeof(long));
+        arena->handles_used = hdr->handles_used;
+        arena->handle_free = hdr->handle_free;
+        if(__check_handles(arena) < 0) {
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    buddy_destroy(arena);
+    return -1;
+}
+
+void buddy_destroy(struct buddy_arena *arena) {
+    // hooks->free has to accept NULL, like kfree and free do
+    arena->hooks->free(arena->tree);
+    arena->hooks->free(arena->free_next);
+    arena->hooks->free(arena->free_prev);
+    arena->hooks->free(arena->slabs);
+    arena->hooks->free(arena->handle_refs);
+    arena->tree = NULL;
+    arena->free_next = NULL;
+    arena->free_prev = NULL;
+    arena->slabs = NULL;
+    arena->handle_refs = NULL;
+}
+
+long buddy_get_mem(struct buddy_arena *arena, long size) {
+    long ref;
+
+    __lock(arena);
+    ref = __get_mem(arena, size, 1);
+    __unlock(arena);
+
+    return ref;
+}
+
+long buddy_get_mem_aligned(struct buddy_arena *arena, long size, long align) {
+    long ref;
+
+    if(align <= 0 || (align & (align-1)) || align > arena->mem_size) {
+        return -1;
+    }
+
+    __lock(arena);
+    ref = __get_mem(arena, size, align);
+    __unlock(arena);
+
+    return ref;
+}
+
+long buddy_get_mem_exact(struct buddy_arena *arena, long size) {
+    long ref;
+
+    __lock(arena);
+    ref = __get_mem_exact(arena, size);
+    __unlock(arena);
+
+    return ref;
+}
+
+int buddy_free_mem(struct buddy_arena *arena, long ref) {
+    int ret;
+
+    __lock(arena);
+    ret = __free_mem(arena, ref);
+    __unlock(arena);
+
+    return ret;
+}
+
+int buddy_resize(struct buddy_arena *arena, long ref, long size) {
+    int ret;
+
+    __lock(arena);
+    ret = __resize(arena, ref, size);
+    __unlock(arena);
+
+    return ret;
+}
+
+int buddy_get_mem_batch(struct buddy_arena *arena, const long *sizes, long *refs, int count) {
+    int succeeded = 0;
+    int i;
+
+    __lock(arena);
+    for(i = 0; i < count; i++) {
+        refs[i] = __get_mem(arena, sizes[i], 1);
+        if(refs[i] >= 0) succeeded++;
+    }
+    __unlock(arena);
+
+    return succeeded;
+}
+
+int buddy_free_mem_batch(struct buddy_arena *arena, const long *refs, int *results, int count) {
+    int freed = 0;
+    int ret;
+    int i;
+
+    __lock(arena);
+    for(i = 0; i < count; i++) {
+        ret = __free_mem(arena, refs[i]);
+        if(ret == 0) freed++;
+        if(results) results[i] = ret;
+    }
+    __unlock(arena);
+
+    return freed;
+}
+
+int buddy_size_to_order(struct buddy_arena *arena, long size) {
+    // Geometry never changes after buddy_init, so no need to lock
+    return __size_to_order(arena, size);
+}
+
+long buddy_alloc_size(struct buddy_arena *arena, long size) {
+    int cls = __slab_class(arena, size);
+    int order = __size_to_order(arena, size);
+
+    if(cls >= 0) {
+        return slab_classes[cls];
+    }
+
+    return order >= 0 ? (long)arena->block_size << order : -1;
+}
+
+int buddy_cache_fill(struct buddy_arena *arena, int order, long *refs, int count) {
+    int block;
+    int n;
+
+    __lock(arena);
+    for(n = 0; n < count; n++) {
+        block = __alloc_block(arena, order, CACHED);
+        if(block < 0) break;
+        refs[n] = NODE_OFFSET(arena, block);
+    }
+    __unlock(arena);
+
+    return n;
+}
+
+int buddy_cache_drain(struct buddy_arena *arena, const long *refs, int count) {
+    int drained = 0;
+    int block;
+    int i;
+
+    __lock(arena);
+    for(i = 0; i < count; i++) {
+        block = __get_block_from_address(arena, refs[i]);
+        if(block >= 0 && arena->tree[block] == CACHED) {
+            __free_block(arena, block);
+            drained++;
+        }
+    }
+    __unlock(arena);
+
+    return drained;
+}
+
+void buddy_reset(struct buddy_arena *arena) {
+    int n;
+
+    __lock(arena);
+    // Every node below the root is stale once the root is FREE, and only the
+    // free lists' heads say what is on them
+    arena->tree[0] = FREE;
+    for(n = 0; n <= BUDDY_MAX_DEPTH; n++) {
+        arena->free_head[n] = -1;
+        arena->stats.free_blocks[n] = 0;
+    }
+    __free_list_push(arena, 0);
+    arena->lazy_pending = 0;
+
+    // The slab table is left as it is, but none of it belongs to this
+    // generation any more
+    arena->generation++;
+    for(n = 0; n < BUDDY_SLAB_CLASSES; n++) {
+        arena->slab_partial[n] = -1;
+    }
+    arena->stats.slabs = 0;
+    arena->stats.slab_objects = 0;
+
+    arena->handles_used = 0;
+    arena->handle_free = -1;
+    arena->compact_cursor = 0;
+    arena->stats.resets++;
+    __unlock(arena);
+}
+
+int buddy_get_handle(struct buddy_arena *arena, long size) {
+    int handle;
+
+    __lock(arena);
+    handle = __get_handle(arena, size);
+    __unlock(arena);
+
+    return handle;
+}
+
+int buddy_free_handle(struct buddy_arena *arena, int handle) {
+    int ret;
+
+    __lock(arena);
+    ret = __free_handle(arena, handle);
+    __unlock(arena);
+
+    return ret;
+}
+
+long buddy_handle_ref(struct buddy_arena *arena, int handle) {
+    long ref = -1;
+
+    __lock(arena);
+    if(0 <= handle && handle < arena->handles_used) {
+        ref = arena->handle_refs[handle];
+    }
+    __unlock(arena);
+
+    return ref < 0 ? -1 : ref;
+}
+
+int buddy_compact(struct buddy_arena *arena, int max_moves,
+                  void (*move)(void *ctx, long dst, long src, long size), void *ctx) {
+    int moved = 0;
+    int handle;
+    int n;
+
+    __lock(arena);
+    for(n = 0; n < arena->handles_used && moved < max_moves; n++) {
+        handle = arena->compact_cursor % arena->handles_used;
+        arena->compact_cursor = handle + 1;
+        if(arena->handle_refs[handle] >= 0) {
+            moved += __compact_one(arena, handle, move, ctx);
+        }
+    }
+    // What was moved away from only makes room once it has been merged
+    if(arena->lazy_pending > 0) {
+        __coalesce(arena);
+    }
+    __unlock(arena);
+
+    return moved;
+}
+
+void buddy_get_stats(struct buddy_arena *arena, struct buddy_stats *stats) {
+    __lock(arena);
+    *stats = arena->stats;
+    __unlock(arena);
+}
+
+int buddy_get_block_from_address(struct buddy_arena *arena, long ref) {
+    int block;
+
+    __lock(arena);
+    block = __get_block_from_address(arena, ref);
+    __unlock(arena);
+
+    return block;
+}
+
+int buddy_check_range(struct buddy_arena *arena, long ref, long size) {
+    long start;
+    long block_size;
+
+    if(size < 0 || buddy_block_bounds(arena, ref, &start, &block_size) < 0) {
+        return -1;
+    }
+
+    // Written so that a huge size can't overflow
+    return (size <= block_size - (ref - start)) ? 0 : -1;
+}
+
+int buddy_block_bounds(struct buddy_arena *arena, long ref, long *start, long *size) {
+    struct buddy_slab *slab;
+    int block;
+    long base;
+    int obj;
+
+    __lock(arena);
+    // Objects in a slab are bounded by their size class, not by the slab.
+    // The slack at the end of a slab belongs to no object
+    slab = __slab_of(arena, ref);
+    if(slab) {
+        base = (slab - arena->slabs) * SLAB_SIZE(arena);
+        obj = (ref - base) / slab_classes[slab->cls];
+        block = obj < SLAB_OBJS(arena, slab->cls) ? 0 : -1;
+        *start = base + obj * slab_classes[slab->cls];
+        *size = slab_classes[slab->cls];
+    } else {
+        block = __get_block_from_address(arena, ref);
+        if(block >= 0 && (arena->tree[block] == RUN || arena->tree[block] == TAIL)) {
+            __run_bounds(arena, block, start, size);
+        } else if(block >= 0) {
+            *start = NODE_OFFSET(arena, block);
+            *size = NODE_SIZE(arena, block);
+        }
+    }
+    __unlock(arena);
+
+    return block >= 0 ? 0 : -1;
+}
@@ -0,0 +1,304 @@
+/* Author: Garrett Scholtes
+ * Date:   2015-11-18
+ *
+ * buddy-core.h - The buddy allocator logic on its own, with no kernel
+ * dependencies.  Used by buddy-driver.c AND by userspace (buddy-bench.c).
+ */
+
+#ifndef BUDDYCORE_H
+#define BUDDYCORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdbool.h>
+#endif
+
+// Largest depth the core supports.  Refs and sizes are longs, but tree nodes
+// are numbered with ints, so the tree can have at most 1<<30 leaves: 16 GB of
+// 16 byte blocks, or 4 TB of 4 KB ones
+#define BUDDY_MAX_DEPTH 30
+
+// Number of slab size classes (see buddy_enable_slabs)
+#define BUDDY_SLAB_CLASSES 12
+
+struct buddy_slab;
+
+// Where a request is placed (see buddy_arena.policy)
+enum buddy_policy {
+    // The smallest free block that fits, popped from the per-order free lists
+    BUDDY_BEST_FIT,
+    // The lowest-addressed free block that fits, found by walking the tree
+    BUDDY_FIRST_FIT,
+    // Requests below large_order from the bottom of the arena, the rest from
+    // the top, so that small and large blocks keep to opposite halves
+    BUDDY_SEGREGATED
+};
+
+// Whoever owns an arena decides how its bookkeeping is allocated and how it
+// is locked.  lock/unlock may be NULL if the arena is never shared
+struct buddy_hooks {
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+    void (*lock)(void *lock_data);
+    void (*unlock)(void *lock_data);
+};
+
+// Counters the core keeps as it goes.  They are only touched while the arena
+// lock is held anyway, so keeping them costs no extra synchronization
+struct buddy_stats {
+    unsigned long splits;
+    unsigned long merges;
+
+    // Deferred merge passes (see lazy_limit)
+    unsigned long coalesces;
+
+    // Number of blocks on each free list
+    int free_blocks[BUDDY_MAX_DEPTH+1];
+
+    // Buddy blocks currently carved into slabs, and live objects in them
+    int slabs;
+    int slab_objects;
+
+    // Blocks moved by buddy_compact
+    unsigned long moves;
+
+    // Calls to buddy_reset
+    unsigned long resets;
+};
+
+struct buddy_arena {
+    // Geometry.  There are 1<<depth blocks of block_size bytes each
+    int depth;
+    int block_size;
+    long mem_size;
+
+    // Placement policy, BUDDY_BEST_FIT unless changed after buddy_init.
+    // Under BUDDY_SEGREGATED, blocks of at least large_order are large
+    // (buddy_init sets it halfway down the tree)
+    enum buddy_policy policy;
+    int large_order;
+
+    // 0 merges buddies on every free.  Otherwise freed blocks stay at their
+    // order, ready for the next request of the same size, until lazy_limit
+    // frees are pending or a request can't be met; then everything that can
+    // be merged is merged in one pass
+    int lazy_limit;
+    int lazy_pending;
+
+    // Size classes, NULL unless buddy_enable_slabs was called.  One entry per
+    // slab-sized stretch of the arena, plus the per-class lists of slabs that
+    // still have free objects
+    struct buddy_slab *slabs;
+    int slab_order;
+    int slab_partial[BUDDY_SLAB_CLASSES];
+
+    // Bumped by buddy_reset.  Slab table entries from an older generation
+    // count as not being slabs
+    unsigned int generation;
+
+    // Handle table, NULL unless buddy_enable_handles was called.  Only the
+    // first handles_used entries mean anything.  A live entry holds its
+    // block's ref, a free one -2 minus the next free handle
+    long *handle_refs;
+    int max_handles;
+    int handles_used;
+    int handle_free;
+    int compact_cursor;
+
+    // The tree of block states, stored heap-style (see buddy-core.c)
+    unsigned char *tree;
+
+    // Per-order free lists, doubly linked through node-indexed arrays
+    int free_head[BUDDY_MAX_DEPTH+1];
+    int *free_next;
+    int *free_prev;
+
+    struct buddy_stats stats;
+
+    // Tree nodes touched by the operation in progress, for the trace hooks
+    int visited;
+
+    const struct buddy_hooks *hooks;
+    void *lock_data;
+};
+
+// A snapshot of an arena starts with this header, followed by the arena's
+// bookkeeping (its tree, slab table and handle table, if any), then by the
+// arena's contents at data_offset, which is page aligned so that a snapshot
+// file can be mmap'd and its contents used in place.  Snapshots are only
+// meant to be read back on the same kind of machine that wrote them
+#define BUDDY_SNAPSHOT_MAGIC 0x59444255 // "UBDY"
+#define BUDDY_SNAPSHOT_VERSION 2
+#define BUDDY_SNAPSHOT_ALIGN 4096
+
+struct buddy_snapshot {
+    unsigned int magic;
+    unsigned int version;
+
+    // Geometry, the same as in buddy-dev.h's geometry64_struct
+    long long mem_size;
+    int block_size;
+    int depth;
+
+    int policy;
+    int large_order;
+    int lazy_limit;
+    int lazy_pending;
+
+    // -1 if the arena has no slabs or no handles
+    int slab_order;
+    int handles_used;
+    int handle_free;
+
+    // Where the contents start, and where the snapshot ends
+    long long data_offset;
+    long long size;
+};
+
+// Sets up an arena of 1<<depth blocks of block_size bytes (a power of two).
+// Returns 0 on success, -1 on bad geometry or if the hooks could not allocate
+int buddy_init(struct buddy_arena *arena, int depth, int block_size,
+               const struct buddy_hooks *hooks, void *lock_data);
+
+// Serves requests that would waste most of their buddy block from slabs
+// instead: buddy blocks carved into objects of one size class (8, 16, 24, 32,
+// 48, 64, 96 ... 512 bytes).  An object's ref is its offset like any other,
+// and buddy_free_mem, buddy_check_range and buddy_block_bounds all know about
+// them.  Call right after buddy_init.  0 on success, -1 if the hooks could
+// not allocate the slab table
+int buddy_enable_slabs(struct buddy_arena *arena);
+
+// Lets the arena hand out handles: stable names for blocks that
+// buddy_compact may move.  Room is made for one handle per minimum block, so
+// the table can never run out.  Call right after buddy_init.
+// 0 on success, -1 if the hooks could not allocate the table
+int buddy_enable_handles(struct buddy_arena *arena);
+
+// Frees every block in the arena at once, slabs and handles included, leaving
+// one free block the size of the arena.  Takes the same time however much is
+// allocated: nothing below the root of the tree is touched
+void buddy_reset(struct buddy_arena *arena);
+
+// Bytes of a snapshot of the arena that come before its contents: the header
+// and the bookkeeping.  This is also the snapshot's data_offset
+long buddy_snapshot_size(struct buddy_arena *arena);
+
+// Writes the header and bookkeeping of a snapshot into buf, which holds size
+// bytes.  The caller appends mem_size bytes of contents.  Blocks that are
+// CACHED are recorded as allocated, so anything sitting unused in a cache
+// should be drained first.  Returns buddy_snapshot_size, or -1 if size is too small
+long buddy_snapshot(struct buddy_arena *arena, void *buf, long size);
+
+// The data_offset that a snapshot starting with hdr must have, or -1 if hdr
+// is not a header this core could have written.  Lets a reader find out how
+// much of a snapshot buddy_restore needs before reading all of it
+long buddy_snapshot_check(const struct buddy_snapshot *hdr);
+
+// Sets up arena from the first size bytes of a snapshot, in place of
+// buddy_init and the buddy_enable_* calls.  The bookkeeping is copied in
+// bulk and the free lists are rebuilt from the tree in address order (so
+// later placements may differ from the original arena's); nothing is replayed.
+// The contents (at data_offset in the snapshot) are the caller's business.
+// The snapshot is checked enough that a corrupt one can't lead the core out
+// of bounds or have it free a block twice.  Returns 0 on success, -1 if it is not a usable snapshot or the
+// hooks could not allocate
+int buddy_restore(struct buddy_arena *arena, const void *snap, long size,
+                  const struct buddy_hooks *hooks, void *lock_data);
+
+// Frees everything buddy_init allocated
+void buddy_destroy(struct buddy_arena *arena);
+
+// Given a memory size, give a reference to that block.
+// Returns a -1 if the request could not be satisfied
+long buddy_get_mem(struct buddy_arena *arena, long size);
+
+// Like buddy_get_mem, but the ref is a multiple of align (a power of two).
+// Blocks are aligned to their own size, so the size is only rounded up to a
+// block, never to align: a free block that happens to sit at an aligned
+// offset is used, else a bigger block is split down from its start.
+// Returns -1 if the request could not be satisfied or align is bad
+long buddy_get_mem_aligned(struct buddy_arena *arena, long size, long align);
+
+// Like buddy_get_mem, but only takes as many minimum blocks as size needs:
+// the unneeded tail of the rounded-up block goes straight back to the free
+// lists.  buddy_free_mem frees the whole run, and buddy_block_bounds
+// reports it as one block.  Returns -1 if the request could not be satisfied
+long buddy_get_mem_exact(struct buddy_arena *arena, long size);
+
+// Resizes the allocation at ref to size bytes without moving it, if it can:
+// a block grows by merging with its free buddies (only if it is the left
+// one) and shrinks by splitting off its upper halves.  Returns 0 if it did, 1
+// if the allocation would have to move (and is left as it was), and -1 if ref
+// is not the start of an allocation
+int buddy_resize(struct buddy_arena *arena, long ref, long size);
+
+// Frees memory.  0 on success, -1 on failure
+int buddy_free_mem(struct buddy_arena *arena, long ref);
+
+// Allocates count blocks while taking the lock only once.  refs[i] gets the ref
+// for sizes[i], or -1.  Returns the number of successful allocations
+int buddy_get_mem_batch(struct buddy_arena *arena, const long *sizes, long *refs, int count);
+
+// Frees count refs while taking the lock only once.  If results is not NULL,
+// results[i] gets 0 or -1 for refs[i].  Returns the number of blocks freed
+int buddy_free_mem_batch(struct buddy_arena *arena, const long *refs, int *results, int count);
+
+// Smallest order (log2 of the size in blocks) whose blocks can hold size
+// bytes, or -1 if size is bigger than the whole arena
+int buddy_size_to_order(struct buddy_arena *arena, long size);
+
+// Takes up to count free blocks of exactly the given order out of the tree in
+// one go and stores their refs in refs.  The blocks are marked CACHED: the
+// caller owns them, and buddy_free_mem refuses them until they come back
+// through buddy_cache_drain.  Returns the number of blocks taken
+int buddy_cache_fill(struct buddy_arena *arena, int order, long *refs, int count);
+
+// Gives count CACHED blocks back to the tree, merging as usual.
+// Returns the number of blocks given back
+int buddy_cache_drain(struct buddy_arena *arena, const long *refs, int count);
+
+// Bytes a successful request of size bytes takes up: its size class if it
+// would come from a slab, else its buddy block.  -1 if size is too big
+long buddy_alloc_size(struct buddy_arena *arena, long size);
+
+// Allocates a block like buddy_get_mem, but returns a handle for it.
+// The block's ref is found with buddy_handle_ref, and may change whenever
+// buddy_compact runs.  Returns -1 if the request could not be satisfied
+int buddy_get_handle(struct buddy_arena *arena, long size);
+
+// Frees the block behind handle, and the handle.  0 on success, -1 on failure.
+// Blocks behind handles must only ever be freed this way
+int buddy_free_handle(struct buddy_arena *arena, int handle);
+
+// The ref of the block behind handle, or -1 if there is no such handle
+long buddy_handle_ref(struct buddy_arena *arena, int handle);
+
+// Moves up to max_moves blocks that are behind handles down to the
+// lowest-addressed free spot big enough for them, so that free space gathers
+// at the top of the arena.  move(ctx, dst, src, size) is called with the lock
+// held for each block whose data has to move.  It may copy it there and then,
+// or, if the caller keeps everyone off the data until it is done, note the
+// moves and make them in the same order after this returns.  Successive calls
+// pick up where the last one stopped.  Returns the number of blocks moved, 0
+// once there is nothing left to gain
+int buddy_compact(struct buddy_arena *arena, int max_moves,
+                  void (*move)(void *ctx, long dst, long src, long size), void *ctx);
+
+// Copies the arena's counters into stats
+void buddy_get_stats(struct buddy_arena *arena, struct buddy_stats *stats);
+
+// Given an address, get the node index of the block that contains
+// the memory at that address.  Returns -1 if ref is out of range
+int buddy_get_block_from_address(struct buddy_arena *arena, long ref);
+
+// Checks that the size bytes starting at ref all lie in the same block, with
+// a single lookup.  0 if they do, -1 if they don't
+int buddy_check_range(struct buddy_arena *arena, long ref, long size);
+
+// Finds the block that contains ref and gives its offset and size.
+// 0 on success, -1 if ref is out of range
+int buddy_block_bounds(struct buddy_arena *arena, long ref, long *start, long *size);
+
+#endif
@@ -13,9 +13,10 @@
 // Our statically chosen major device number
 #define MAJOR_NUM 150
 
-// Change the value of BUDDY_BLOCK_DEPTH to play around with the memory size.
-// My system doesn't seem to appreciate BUDDY_BLOCK_DEPTH = 12 (must not like
-// being coerced to allocate 16 MB of contiguous space)
+// These are only the defaults.  The driver takes mem_size and block_size module
+// parameters (e.g. insmod buddy-driver.ko mem_size=16777216 block_size=16), so
+// userspace should ask for the real geometry with IOCTL_GET_GEOMETRY rather
+// than trust these.  The arena is vmalloc'd, so it need not be contiguous
 #define BUDDY_BLOCK_DEPTH 4
 #define BUDDY_BLOCK_SIZE (1<<BUDDY_BLOCK_DEPTH)
 #define BUDDY_NUM_BLOCKS (1<<BUDDY_BLOCK_DEPTH)
@@ -23,7 +24,14 @@
 
 
 
-// Define structs used to pass parameters
+// Define structs used to pass parameters.  These hold refs and sizes in ints,
+// so they only work on arenas of up to INT_MAX bytes: on a bigger one the
+// ioctl fails with EOVERFLOW and return_val is left alone.  The 64-bit structs
+// further down work on any arena, but only cover getting, freeing, reading,
+// writing, the geometry and creating arenas.  Exact gets, realloc, batches,
+// vectors, write_mem_len, handles and rings have no 64-bit path, so they
+// can't be used on a bigger arena (see IOCTL_CREATE_ARENA64).  Snapshots
+// take longs and work on any arena
 struct get_mem_struct {
     int mem;
     int size;
@@ -31,6 +39,17 @@ struct get_mem_struct {
     int return_val;
 };
 
+// Like get_mem_struct, but the ref returned is a multiple of align (a power of two)
+struct get_mem_aligned_struct {
+    int mem;
+    int size;
+    int align;
+
+    int return_val;
+};
+
+// In the shared arena, only the file handle that got a block can free it (or
+// resize it).  Whatever a handle still holds when it is closed is freed then
 struct free_mem_struct {
     int mem;
     int ref;
@@ -38,6 +57,17 @@ struct free_mem_struct {
     int return_val;
 };
 
+// Resize the block ref to size bytes.  return_val is the block's ref
+// afterwards (the same one if it could be resized in place) or -1, in which
+// case the old block is left as it was
+struct realloc_mem_struct {
+    int mem;
+    int ref;
+    int size;
+
+    int return_val;
+};
+
 struct write_mem_struct {
     int mem;
     int ref;
@@ -46,6 +76,155 @@ struct write_mem_struct {
     int return_val;
 };
 
+// Like write_mem_struct, but writes exactly size bytes from buf, zeros included
+struct write_mem_len_struct {
+    int mem;
+    int ref;
+    char *buf;
+    int size;
+
+    int return_val;
+};
+
+// One segment of a vectored read or write: len bytes at offset within the
+// block ref, to or from buf.  The whole segment has to lie inside that block
+struct mem_iovec {
+    int ref;
+    int offset;
+    int len;
+    char *buf;
+};
+
+// Vectored read or write of count segments.  return_val is the total number
+// of bytes moved, or -1 if any segment was out of bounds (segments before it
+// have already been moved)
+struct mem_iovec_struct {
+    int mem;
+    struct mem_iovec *iov;
+    int count;
+
+    int return_val;
+};
+
+// Batched get_mem.  refs[i] gets the ref for sizes[i], or -1 if that request
+// could not be satisfied.  return_val is the number of successful allocations
+struct get_mem_batch_struct {
+    int mem;
+    int count;
+    int *sizes;
+    int *refs;
+
+    int return_val;
+};
+
+// Batched free_mem.  results[i] gets 0 or -1 for refs[i] (results may be NULL).
+// return_val is the number of blocks freed
+struct free_mem_batch_struct {
+    int mem;
+    int count;
+    int *refs;
+    int *results;
+
+    int return_val;
+};
+
+// The geometry of the arena the driver is actually running with.
+// There are 1<<depth blocks of block_size bytes, mem_size bytes in total
+struct geometry_struct {
+    int mem;
+
+    int mem_size;
+    int block_size;
+    int depth;
+
+    int return_val;
+};
+
+// Give the file handle an arena of its own, of mem_size bytes in blocks of
+// block_size bytes (both powers of two), placing blocks by policy.  Has to
+// come before the handle's first allocation.  Everything done through the
+// handle afterwards (including mmap) uses that arena, which goes away when
+// the handle is closed.  The arena and the bookkeeping for its blocks have to
+// fit in the driver's max_private_size, so smaller blocks mean a smaller arena
+struct create_arena_struct {
+    int mem;
+    int mem_size;
+    int block_size;
+    int flags;
+    int policy;
+
+    int return_val;
+};
+
+// Placement policies for IOCTL_CREATE_ARENA (and the driver's policy parameter)
+#define BUDDY_POLICY_DEFAULT 0 // Whatever the module was loaded with
+#define BUDDY_POLICY_BEST_FIT 1 // The smallest free block that fits
+#define BUDDY_POLICY_FIRST_FIT 2 // The lowest-addressed free block that fits
+#define BUDDY_POLICY_SEGREGATED 3 // Small blocks from the bottom of the arena, large ones from the top
+
+// Flags for IOCTL_CREATE_ARENA
+#define BUDDY_ARENA_HANDLES 1 // get_mem hands out handles, and IOCTL_COMPACT may move their blocks
+
+// In an arena created with BUDDY_ARENA_HANDLES, every ioctl that takes a ref
+// takes a handle instead.  Only get_mem, free_mem, the reads and writes and
+// the ring's commands work there; the rest fail.  return_val is the offset
+// the block behind handle has in the mmap'd arena until the next
+// IOCTL_COMPACT, or -1
+struct resolve_handle_struct {
+    int mem;
+    int handle;
+
+    int return_val;
+};
+
+// Move up to max_moves blocks (no limit if max_moves <= 0) of a handle arena
+// toward its start, so that its free space runs together.  return_val is
+// the number of blocks moved, or -1 if the arena has no handles
+struct compact_struct {
+    int mem;
+    int max_moves;
+
+    int return_val;
+};
+
+// Free every block in the handle's private arena at once, however many there
+// are.  return_val is 0, or -1 if the handle is using the shared arena
+struct reset_arena_struct {
+    int mem;
+
+    int return_val;
+};
+
+// Snapshots, for bringing an arena back after a restart without replaying
+// every allocation.  A snapshot is a header and the arena's bookkeeping (see
+// struct buddy_snapshot in buddy-core.h) followed, at the header's
+// data_offset, by the arena's contents.  data_offset is page aligned, so a
+// snapshot saved to a file can be mmap'd and used in place.
+// Copy the handle's arena into buf, which holds size bytes.  With a NULL buf
+// nothing is copied.  return_val is the size of the snapshot either way, or -1
+// if buf is too small.  Blocks are not moved by IOCTL_COMPACT meanwhile, but
+// other handles keep using the shared arena, so its snapshot is only a
+// consistent one if they are idle
+struct snapshot_arena_struct {
+    int mem;
+    char *buf;
+    long size;
+
+    long return_val;
+};
+
+// Give the handle a private arena that is a copy of the snapshot in the size
+// bytes at buf, contents and all.  Like IOCTL_CREATE_ARENA, only possible
+// before the handle's first allocation and only up to the driver's
+// max_private_size.  return_val is 0, or -1
+struct restore_arena_struct {
+    int mem;
+    const char *buf;
+    long size;
+
+    int return_val;
+};
+
 struct read_mem_struct {
     int mem;
     int ref;
@@ -55,6 +234,173 @@ struct read_mem_struct {
     int return_val;
 };
 
+// Submission/completion rings.  After IOCTL_SETUP_RING, mmap'ing the handle at
+// BUDDY_RING_OFFSET gives a struct buddy_ring shared with the driver.
+// Userspace fills sq[sq_tail % BUDDY_RING_ENTRIES] and bumps sq_tail; the
+// driver consumes up to sq_tail, posting one cq entry per command and bumping
+// cq_tail; userspace reaps up to cq_tail and bumps cq_head.  Each side only
+// ever writes its own two indices, with release/acquire ordering.  Entries
+// hold ints like the original ioctl structs, so a handle whose arena is more
+// than INT_MAX bytes can't have rings
+#define BUDDY_RING_ENTRIES 256 // A power of two
+#define BUDDY_RING_OFFSET (1L<<40) // Arenas are kept smaller than this, so it is past the end of any of them
+
+// Commands that can be submitted
+#define BUDDY_OP_GET_MEM 0 // size bytes; the result is the ref or -1
+#define BUDDY_OP_FREE_MEM 1 // ref; the result is 0 or -1
+#define BUDDY_OP_COPY_MEM 2 // size bytes from block src to block ref; the result is size or -1
+
+// Flags for IOCTL_SETUP_RING
+#define BUDDY_RING_POLL 1 // A kernel thread polls the ring, so most submissions need no syscall at all
+
+// Set by the polling thread in buddy_ring.flags when it has gone to sleep.
+// Only then does a submission need IOCTL_RING_ENTER to wake it up
+#define BUDDY_RING_NEED_WAKEUP 1
+
+struct buddy_sqe {
+    int opcode;
+    int ref;
+    int src;
+    int size;
+    unsigned long user_data; // Handed back untouched in the completion
+};
+
+struct buddy_cqe {
+    unsigned long user_data;
+    int result;
+};
+
+struct buddy_ring {
+    unsigned int sq_head; // Written by the driver
+    unsigned int sq_tail; // Written by userspace
+    unsigned int cq_head; // Written by userspace
+    unsigned int cq_tail; // Written by the driver
+    unsigned int flags;   // Written by the driver
+
+    struct buddy_sqe sq[BUDDY_RING_ENTRIES];
+    struct buddy_cqe cq[BUDDY_RING_ENTRIES];
+};
+
+// Give the file handle a pair of rings.  flags is 0 or BUDDY_RING_POLL.
+// Only one ring per handle; it goes away when the handle is closed
+struct setup_ring_struct {
+    int mem;
+    int flags;
+
+    int return_val;
+};
+
+// Ring the doorbell.  Without BUDDY_RING_POLL the driver consumes the
+// submissions right away and return_val is how many it consumed.  With it,
+// the polling thread is woken and return_val is 0
+struct ring_enter_struct {
+    int mem;
+
+    int return_val;
+};
+
+// Recording.  With the driver loaded with record=1, every get and free on the
+// shared arena is logged, and reading /sys/kernel/debug/buddy/trace gives
+// (and consumes) the log as a stream of these.  Each CPU keeps its own log,
+// so the stream is only in order per CPU: sort it by time_ns to merge them
+#define BUDDY_RECORD_GET 0 // size bytes; ref is the block handed out, or -1
+#define BUDDY_RECORD_GET_ALIGNED 1 // Like BUDDY_RECORD_GET, with arg the alignment
+#define BUDDY_RECORD_GET_EXACT 2 // Like BUDDY_RECORD_GET, with only size bytes kept
+#define BUDDY_RECORD_FREE 3 // ref was freed
+#define BUDDY_RECORD_RESIZE 4 // ref was resized in place to size bytes
+
+struct buddy_record {
+    unsigned long long time_ns; // ktime_get_ns
+    long long size;
+    long long ref;
+    long long arg;
+    int op; // BUDDY_RECORD_*
+    unsigned int owner; // Which file handle, while it is open.  Ids are reused
+    int cpu;
+};
+
+// The 64-bit ABI.  Refs and sizes are u64s, and errors come back on their own
+// in error rather than as negative values: 0 on success, else one of
+//     EINVAL  a bad version, size, alignment, ref or geometry
+//     ENOMEM  nothing big enough is free
+//     EFAULT  buf could not be accessed
+//     EPERM   the block belongs to another file handle
+//     EOVERFLOW  the arena would be too big for something the handle uses
+//             that has no 64-bit ioctls
+// Outputs are only filled in when error is 0.  version has to be
+// BUDDY_ABI_VERSION, so that these can change without breaking old callers
+#define BUDDY_ABI_VERSION 2
+
+// Allocate size bytes at a multiple of align (a power of two, or 0 for none
+// beyond the block's own).  ref is the block's offset in the mmap'd arena
+struct get_mem64_struct {
+    int mem;
+    int version;
+    unsigned long long size;
+    unsigned long long align;
+
+    unsigned long long ref;
+    int error;
+};
+
+struct free_mem64_struct {
+    int mem;
+    int version;
+    unsigned long long ref;
+
+    int error;
+};
+
+// Read exactly size bytes at ref into buf.  They have to lie in one block
+struct read_mem64_struct {
+    int mem;
+    int version;
+    unsigned long long ref;
+    char *buf;
+    unsigned long long size;
+
+    int error;
+};
+
+// Write exactly size bytes from buf at ref, zeros included.  They have to lie in one block
+struct write_mem64_struct {
+    int mem;
+    int version;
+    unsigned long long ref;
+    char *buf;
+    unsigned long long size;
+
+    int error;
+};
+
+struct geometry64_struct {
+    int mem;
+    int version;
+
+    unsigned long long mem_size;
+    int block_size;
+    int depth;
+
+    int error;
+};
+
+// Like create_arena_struct, for private arenas of more than INT_MAX bytes.
+// Handles and rings are ints, so an arena that big can't have
+// BUDDY_ARENA_HANDLES and can't be created on a handle with rings (error is
+// EOVERFLOW).  Nor will IOCTL_SETUP_RING give rings to a handle whose arena
+// is that big, or IOCTL_RESTORE_ARENA restore one with handles.  mem_size
+// has to be less than BUDDY_RING_OFFSET, where the rings are mapped
+struct create_arena64_struct {
+    int mem;
+    int version;
+    unsigned long long mem_size;
+    int block_size;
+    int flags;
+    int policy;
+
+    int error;
+};
+
 
 
 // Request to allocate a block of memory
@@ -81,5 +427,144 @@ struct read_mem_struct {
 #define IOCTL_READ_MEM _IOR(MAJOR_NUM, 3, void *)
 
 
+// Request to allocate a whole array of blocks in one call
+// Last parameter get casted to:
+//     struct get_mem_batch_struct *
+#define IOCTL_GET_MEM_BATCH _IOR(MAJOR_NUM, 4, void *)
+
+
+// Request to free a whole array of blocks in one call
+// Last parameter get casted to:
+//     struct free_mem_batch_struct *
+#define IOCTL_FREE_MEM_BATCH _IOR(MAJOR_NUM, 5, void *)
+
+
+// Request the geometry of the arena
+// Last parameter get casted to:
+//     struct geometry_struct *
+#define IOCTL_GET_GEOMETRY _IOR(MAJOR_NUM, 6, void *)
+
+
+// Request a private arena for this file handle
+// Last parameter get casted to:
+//     struct create_arena_struct *
+#define IOCTL_CREATE_ARENA _IOR(MAJOR_NUM, 7, void *)
+
+
+// Request to write an explicit number of bytes to memory
+// Last parameter get casted to:
+//     struct write_mem_len_struct *
+#define IOCTL_WRITE_MEM_LEN _IOR(MAJOR_NUM, 8, void *)
+
+
+// Request to write several segments to memory
+// Last parameter get casted to:
+//     struct mem_iovec_struct *
+#define IOCTL_WRITEV_MEM _IOR(MAJOR_NUM, 9, void *)
+
+
+// Request to read several segments from memory
+// Last parameter get casted to:
+//     struct mem_iovec_struct *
+#define IOCTL_READV_MEM _IOR(MAJOR_NUM, 10, void *)
+
+
+// Request a submission/completion ring pair
+// Last parameter get casted to:
+//     struct setup_ring_struct *
+#define IOCTL_SETUP_RING _IOR(MAJOR_NUM, 11, void *)
+
+
+// Request that the ring's submissions be consumed
+// Last parameter get casted to:
+//     struct ring_enter_struct *
+#define IOCTL_RING_ENTER _IOR(MAJOR_NUM, 12, void *)
+
+
+// Request a block of memory that only takes as many minimum blocks as it needs
+// (the rest of the rounded-up block stays free).  free_mem frees all of it
+// Last parameter get casted to:
+//     struct get_mem_struct *
+#define IOCTL_GET_MEM_EXACT _IOR(MAJOR_NUM, 13, void *)
+
+
+// Request to resize a block of memory, keeping its contents
+// Last parameter get casted to:
+//     struct realloc_mem_struct *
+#define IOCTL_REALLOC_MEM _IOR(MAJOR_NUM, 14, void *)
+
+
+// Request a block of memory at an aligned offset
+// Last parameter get casted to:
+//     struct get_mem_aligned_struct *
+#define IOCTL_GET_MEM_ALIGNED _IOR(MAJOR_NUM, 15, void *)
+
+
+// Request the offset of the block behind a handle
+// Last parameter get casted to:
+//     struct resolve_handle_struct *
+#define IOCTL_RESOLVE_HANDLE _IOR(MAJOR_NUM, 16, void *)
+
+
+// Request that a handle arena be compacted
+// Last parameter get casted to:
+//     struct compact_struct *
+#define IOCTL_COMPACT _IOR(MAJOR_NUM, 17, void *)
+
+
+// Request that a private arena be emptied
+// Last parameter get casted to:
+//     struct reset_arena_struct *
+#define IOCTL_RESET_ARENA _IOR(MAJOR_NUM, 18, void *)
+
+
+// Request a snapshot of the handle's arena
+// Last parameter get casted to:
+//     struct snapshot_arena_struct *
+#define IOCTL_SNAPSHOT_ARENA _IOR(MAJOR_NUM, 19, void *)
+
+
+// Request a private arena restored from a snapshot
+// Last parameter get casted to:
+//     struct restore_arena_struct *
+#define IOCTL_RESTORE_ARENA _IOR(MAJOR_NUM, 20, void *)
+
+
+// Request to allocate a block of memory, 64-bit ABI
+// Last parameter get casted to:
+//     struct get_mem64_struct *
+#define IOCTL_GET_MEM64 _IOR(MAJOR_NUM, 21, void *)
+
+
+// Request to free memory, 64-bit ABI
+// Last parameter get casted to:
+//     struct free_mem64_struct *
+#define IOCTL_FREE_MEM64 _IOR(MAJOR_NUM, 22, void *)
+
+
+// Request to read from memory, 64-bit ABI
+// Last parameter get casted to:
+//     struct read_mem64_struct *
+#define IOCTL_READ_MEM64 _IOR(MAJOR_NUM, 23, void *)
+
+
+// Request to write to memory, 64-bit ABI
+// Last parameter get casted to:
+//     struct write_mem64_struct *
+#define IOCTL_WRITE_MEM64 _IOR(MAJOR_NUM, 24, void *)
+
+
+// Request the geometry of the arena, 64-bit ABI
+// Last parameter get casted to:
+//     struct geometry64_struct *
+#define IOCTL_GET_GEOMETRY64 _IOR(MAJOR_NUM, 25, void *)
+
+
+// Request a private arena for this file handle, 64-bit ABI
+// Last parameter get casted to:
+//     struct create_arena64_struct *
+#define IOCTL_CREATE_ARENA64 _IOR(MAJOR_NUM, 26, void *)
+
+
 
 #endif
\ No newline at end of file
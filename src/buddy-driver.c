@@ -8,297 +8,2333 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
-#include <linux/slab.h> // kmalloc, kfree
+#include <linux/slab.h> // kvmalloc, kvfree
+#include <linux/vmalloc.h> // vmalloc_user, vfree
+#include <linux/mm.h> // remap_vmalloc_range
 #include <asm/uaccess.h>
 #include <linux/string.h> // memset, strlen
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/log2.h> // is_power_of_2, ilog2
+#include <linux/overflow.h> // check_mul_overflow, check_add_overflow
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h> // ktime_get_ns
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/idr.h> // ida_alloc_min
+#include <linux/xarray.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
 
 #include "buddy-dev.h"
 #define DEVICE_NAME "mem_dev"
 
 MODULE_LICENSE("GPL");
 
-// Is device open?  Prevents concurent access into the same device
-static int Device_Open = 0;
-// The actual block of memory to touch and play with
-static char *memory;
-
 /// ------------------------ BUDDY ALLOCATOR LOGIC ------------------------- ///
 
-// A struct type keep track of our blocks and how they are fragmented.
-// A better way would be to keep an array to represent the binary tree.  Would use less space
-enum block_state {PARENT, ALLOCATED, FREE};
-struct block_node {
-    enum block_state state;
-    struct block_node *parent;
-    struct block_node *left_child;
-    struct block_node *right_child;
-};
+// Route the core's trace hooks to the tracepoints in buddy-trace.h
+#define CREATE_TRACE_POINTS
+#include "buddy-trace.h"
+#define buddy_trace_get_mem(size, order, ref, visited) trace_buddy_get_mem(size, order, ref, visited)
+#define buddy_trace_free_mem(ref, order, ret, visited) trace_buddy_free_mem(ref, order, ret, visited)
+#define buddy_trace_split(ref, order) trace_buddy_split(ref, order)
+#define buddy_trace_merge(ref, order) trace_buddy_merge(ref, order)
+
+// The allocator itself lives in buddy-core.c so that it can also be built and
+// benchmarked in userspace.  It is compiled straight into this module.
+#include "buddy-core.c"
+
+// The geometry of the arena.  Both have to be powers of two
+static long mem_size = MEM_SIZE;
+module_param(mem_size, long, 0444);
+MODULE_PARM_DESC(mem_size, "Size of the arena in bytes (a power of two)");
+
+static int block_size = BUDDY_BLOCK_SIZE;
+module_param(block_size, int, 0444);
+MODULE_PARM_DESC(block_size, "Size of the smallest block in bytes (a power of two)");
+
+// Where get_mem places blocks, one of the BUDDY_POLICY_* values.  Private
+// arenas can pick their own.  By default get_mem pops the smallest free block
+// that fits from per-order free lists
+static int policy = BUDDY_POLICY_BEST_FIT;
+module_param(policy, int, 0444);
+MODULE_PARM_DESC(policy, "Placement policy: 1 best-fit, 2 first-fit, 3 small and large blocks at opposite ends");
+
+// Loading with first_fit=1 is the same as policy=2, the old behaviour of always
+// handing out the lowest-addressed free block that fits (which is what
+// buddy-test.c's misc_test was written for)
+static bool first_fit = false;
+module_param(first_fit, bool, 0444);
+MODULE_PARM_DESC(first_fit, "Use lowest-address first-fit instead of per-order free lists");
+
+// Merging buddies on every free makes a loop of same-sized get/free calls
+// split the arena all the way down and merge it back up every time.  With
+// lazy_coalesce=N, freed blocks stay where they are until N frees are
+// pending (or a request can't be met) and are then merged in one pass
+static int lazy_coalesce = 0;
+module_param(lazy_coalesce, int, 0444);
+MODULE_PARM_DESC(lazy_coalesce, "Frees to leave unmerged before coalescing them all (0 merges on every free)");
+
+// A 17 byte request takes a 32 byte block.  With slabs=1, requests that would
+// waste most of their block get an object from a slab of their size class instead
+static bool slabs = false;
+module_param(slabs, bool, 0444);
+MODULE_PARM_DESC(slabs, "Serve small requests from slabs of fixed-size objects");
+
+// Private arenas created with IOCTL_CREATE_ARENA can be at most this big,
+// bookkeeping included (see arena_footprint)
+static long max_private_size = 1<<24;
+module_param(max_private_size, long, 0644);
+MODULE_PARM_DESC(max_private_size, "Most kernel memory a single file handle's own arena may take, bookkeeping included");
+
+// An arena: the buddy tree, the lock that guards it, and the actual block of
+// memory to touch and play with.  The memory is page backed (rather than
+// kmalloc'd) so that it can be mmap'd into user space.  The lock is only held
+// while the tree is split, merged or looked up -- never while data is copied
+// to or from user space -- so any number of openers can share an arena
+struct mem_arena {
+    struct buddy_arena buddy;
+    spinlock_t lock;
+    char *memory;
+
+    // Only used in handle arenas: held for reading while a handle's block is
+    // being looked at, and for writing while compact_arena moves blocks
+    struct rw_semaphore compact_lock;
+};
+
+// The arena every file handle uses unless it creates its own
+static struct mem_arena shared_arena;
+
+// A file handle's submission/completion rings (see struct buddy_ring)
+struct mem_ring {
+    // Mapped into user space, so nothing in it can be trusted
+    struct buddy_ring *shared;
+
+    // The driver's own copies of the two indices it owns
+    unsigned int sq_head;
+    unsigned int cq_tail;
+
+    // Only one consumer at a time
+    struct mutex lock;
+
+    // The polling thread, or NULL if submissions are only consumed on IOCTL_RING_ENTER
+    struct task_struct *thread;
+};
+
+// What each open file handle keeps in file->private_data
+struct mem_file {
+    // NULL until the handle either allocates from the shared arena or creates
+    // its own arena, whichever comes first.  Never changes after that
+    struct mem_arena *arena;
+
+    // NULL until IOCTL_SETUP_RING.  Never changes after that
+    struct mem_ring *ring;
+
+    // What the handle's blocks in the shared arena are tagged with (see
+    // block_owners), and how many blocks it holds there
+    u32 owner;
+    atomic_t owned;
+};
+
+// The tree of a big arena can be too big for kmalloc, so let it fall back to vmalloc
+static void *buddy_kvmalloc(size_t size) {
+    return kvmalloc(size, GFP_KERNEL);
+}
+
+static void buddy_kvfree(void *ptr) {
+    kvfree(ptr);
+}
+
+// How many times someone had to wait for the shared arena's lock (shown in
+// the debugfs stats).  Only ever bumped while holding that lock, so it needs
+// no locking of its own
+static unsigned long lock_contended = 0;
+
+static void buddy_spin_lock_counted(void *lock) {
+    if(!spin_trylock(lock)) {
+        spin_lock(lock);
+        lock_contended++;
+    }
+}
+
+static void buddy_spin_lock(void *lock) {
+    spin_lock(lock);
+}
+
+static void buddy_spin_unlock(void *lock) {
+    spin_unlock(lock);
+}
+
+static const struct buddy_hooks buddy_shared_hooks = {
+    .alloc = buddy_kvmalloc,
+    .free = buddy_kvfree,
+    .lock = buddy_spin_lock_counted,
+    .unlock = buddy_spin_unlock
+};
+
+static const struct buddy_hooks buddy_private_hooks = {
+    .alloc = buddy_kvmalloc,
+    .free = buddy_kvfree,
+    .lock = buddy_spin_lock,
+    .unlock = buddy_spin_unlock
+};
+
+static void teardown_arena(struct mem_arena *ma) {
+    buddy_destroy(&ma->buddy);
+    vfree(ma->memory);
+}
+
+// The core's policy for one of the BUDDY_POLICY_* values, or -1 if it isn't one
+static int core_policy(int p) {
+    if(p == BUDDY_POLICY_DEFAULT) {
+        p = first_fit ? BUDDY_POLICY_FIRST_FIT : policy;
+    }
+
+    switch(p) {
+    case BUDDY_POLICY_DEFAULT:
+    case BUDDY_POLICY_BEST_FIT:
+        return BUDDY_BEST_FIT;
+    case BUDDY_POLICY_FIRST_FIT:
+        return BUDDY_FIRST_FIT;
+    case BUDDY_POLICY_SEGREGATED:
+        return BUDDY_SEGREGATED;
+    default:
+        return -1;
+    }
+}
+
+// Sets up an arena of size bytes in blocks of bsize bytes, placing blocks by
+// one of the BUDDY_POLICY_* values.  The arena has to end below
+// BUDDY_RING_OFFSET, or mmap couldn't tell it from the rings.
+// 0 on success, or a -errno
+static int setup_arena(struct mem_arena *ma, long size, int bsize, int placement, const struct buddy_hooks *hooks) {
+    if(!is_power_of_2(size) || !is_power_of_2(bsize) || size < bsize || core_policy(placement) < 0 ||
+       size >= BUDDY_RING_OFFSET) {
+        return -EINVAL;
+    }
+
+    spin_lock_init(&ma->lock);
+    init_rwsem(&ma->compact_lock);
+
+    // vmalloc_user hands back zeroed, page aligned memory that may be mapped
+    // into user space.  The mapping is rounded up to whole pages.  Being
+    // vmalloc'd, the arena does not have to be physically contiguous
+    ma->memory = vmalloc_user(PAGE_ALIGN(size));
+    if(!ma->memory) {
+        return -ENOMEM;
+    }
+
+    if(buddy_init(&ma->buddy, ilog2(size / bsize), bsize, hooks, &ma->lock) < 0) {
+        vfree(ma->memory);
+        return -ENOMEM;
+    }
+    ma->buddy.policy = core_policy(placement);
+    ma->buddy.lazy_limit = max(lazy_coalesce, 0);
+    if(slabs && buddy_enable_slabs(&ma->buddy) < 0) {
+        teardown_arena(ma);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// What an arena of size bytes in blocks of bsize costs the kernel: the memory
+// itself plus the core's bookkeeping, which is a tree node and two free list
+// links per node, a handle per block and a slab entry per slab.  With tiny
+// blocks the bookkeeping outweighs the memory, so it has to be counted too.
+// The geometry comes from user space, so -EINVAL if the sum overflows
+static long arena_footprint(long size, int bsize, bool handles, bool with_slabs) {
+    long blocks = size / bsize;
+    long slab_entries = max(size / max((long)bsize, (long)SLAB_BYTES), 8L);
+    long bytes;
+    long part;
+
+    // The tree has just under two nodes per block
+    if(check_mul_overflow(blocks, (long)(2 * (1 + 2 * sizeof(int))), &part) ||
+       check_add_overflow(size, part, &bytes)) {
+        return -EINVAL;
+    }
+    if(handles && (check_mul_overflow(blocks, (long)sizeof(long), &part) ||
+                   check_add_overflow(bytes, part, &bytes))) {
+        return -EINVAL;
+    }
+    if(with_slabs && (check_mul_overflow(slab_entries, (long)sizeof(struct buddy_slab), &part) ||
+                      check_add_overflow(bytes, part, &bytes))) {
+        return -EINVAL;
+    }
+
+    return bytes;
+}
+
+// The arena a file handle works on
+static struct mem_arena *file_arena(struct file *file) {
+    struct mem_file *mf = file->private_data;
+    struct mem_arena *ma = READ_ONCE(mf->arena);
+
+    return ma ? ma : &shared_arena;
+}
+
+// Like file_arena, but if the handle hasn't chosen yet, it now sticks with the
+// shared arena.  Used by everything that allocates
+static struct mem_arena *file_arena_commit(struct file *file) {
+    struct mem_file *mf = file->private_data;
+
+    cmpxchg(&mf->arena, NULL, &shared_arena);
+
+    return READ_ONCE(mf->arena);
+}
+
+// Whether the arena was created with BUDDY_ARENA_HANDLES, in which case what
+// userspace calls a ref is really a handle
+static bool handle_arena(struct mem_arena *ma) {
+    return ma->buddy.handle_refs != NULL;
+}
+
+// Between hold_refs and release_refs, resolve_ref turns a ref from userspace
+// into the block's offset, and compaction can't move the block.  resolve_ref
+// returns -1 if there is no such handle, which every range check rejects
+static void hold_refs(struct mem_arena *ma) {
+    if(handle_arena(ma)) {
+        down_read(&ma->compact_lock);
+    }
+}
+
+static void release_refs(struct mem_arena *ma) {
+    if(handle_arena(ma)) {
+        up_read(&ma->compact_lock);
+    }
+}
+
+static long resolve_ref(struct mem_arena *ma, long ref) {
+    if(!handle_arena(ma)) {
+        return ref;
+    }
+    return ref == (int)ref ? buddy_handle_ref(&ma->buddy, ref) : -1;
+}
+
+/// ------------------------- PER-CPU MAGAZINES ---------------------------- ///
+
+// Small blocks in the shared arena are served from per-CPU magazines of pre-split blocks so that
+// most small get_mem/free_mem calls never touch the arena lock.  Magazines are
+// refilled from and drained to the tree MAGAZINE_BATCH blocks at a time.
+// Blocks sitting in (or handed out from) a magazine are CACHED in the tree
+static bool magazines = true;
+module_param(magazines, bool, 0444);
+MODULE_PARM_DESC(magazines, "Serve small blocks from per-CPU magazines");
+
+// Only best-fit can be served from magazines: the other policies promise where
+// a block comes from, which a cache can't.  Small requests are the slabs' job
+// when there are slabs
+static bool use_magazines(void) {
+    return magazines && shared_arena.buddy.policy == BUDDY_BEST_FIT && !slabs;
+}
+
+#define MAGAZINE_ORDERS 3 // Orders 0, 1 and 2 are cached
+#define MAGAZINE_SIZE 32  // Most blocks a magazine holds
+#define MAGAZINE_BATCH 16 // Blocks moved per refill or drain
+
+struct magazine {
+    int count;
+    long refs[MAGAZINE_SIZE];
+};
+
+// The lock is practically never contended: only its own CPU takes it, except
+// when drain_magazines runs.  It keeps the cache line local, unlike the arena lock
+struct cpu_cache {
+    spinlock_t lock;
+    struct magazine mags[MAGAZINE_ORDERS];
+};
+
+static DEFINE_PER_CPU(struct cpu_cache, cpu_caches);
+
+// One byte per minimum block: order+1 if the block starting there was handed
+// out by a magazine, 0 otherwise.  Swapped atomically on free, so a double
+// free of a magazine block falls through to buddy_free_mem, which refuses it
+static unsigned char *magazine_tags;
+
+// Magazines back off when less than this much of the shared arena is free in
+// the tree: they are drained once, and until the tree recovers they neither
+// refill nor keep what is freed.  A failed request still drains them as well
+static int magazine_low_water = 5;
+module_param(magazine_low_water, int, 0644);
+MODULE_PARM_DESC(magazine_low_water, "Percent of the shared arena below which free memory counts as low, and magazines give their blocks back (0 to only drain when a request fails)");
+
+// Set while the tree is below magazine_low_water
+static bool arena_low;
+
+// Whether the tree is below magazine_low_water.  The core's free list counts
+// are read without its lock, which is close enough for a watermark
+static bool arena_short(void) {
+    long free_blocks = 0;
+    int order;
+
+    for(order = 0; order <= shared_arena.buddy.depth; order++) {
+        free_blocks += (long)READ_ONCE(shared_arena.buddy.stats.free_blocks[order]) << order;
+    }
+
+    return free_blocks * 100 < (long)READ_ONCE(magazine_low_water) * (shared_arena.buddy.mem_size / shared_arena.buddy.block_size);
+}
+
+// Gives every cached block on every CPU back to the tree.  Called when a
+// request fails, in case the space it needs is sitting in magazines, and
+// when the tree goes below magazine_low_water
+static void drain_magazines(void) {
+    struct cpu_cache *cache;
+    int cpu;
+    int order;
+
+    for_each_possible_cpu(cpu) {
+        cache = per_cpu_ptr(&cpu_caches, cpu);
+        spin_lock(&cache->lock);
+        for(order = 0; order < MAGAZINE_ORDERS; order++) {
+            buddy_cache_drain(&shared_arena.buddy, cache->mags[order].refs, cache->mags[order].count);
+            cache->mags[order].count = 0;
+        }
+        spin_unlock(&cache->lock);
+    }
+}
+
+// Hands out a block for size bytes from this CPU's magazine, refilling it from
+// the tree if it is empty.  -1 if size is not cached or nothing was available
+static long magazine_get(long size) {
+    struct cpu_cache *cache;
+    struct magazine *mag;
+    bool low = false;
+    int order;
+    long ref = -1;
+    long tmp;
+    int i;
+
+    order = buddy_size_to_order(&shared_arena.buddy, size);
+    if(!use_magazines() || order < 0 || MAGAZINE_ORDERS <= order) {
+        return -1;
+    }
+
+    // Being migrated right after picking the cache is harmless, the lock
+    // makes it safe to use another CPU's magazine
+    cache = raw_cpu_ptr(&cpu_caches);
+    spin_lock(&cache->lock);
+    mag = &cache->mags[order];
+    if(mag->count == 0) {
+        low = arena_short();
+        if(!low) WRITE_ONCE(arena_low, false);
+    }
+    if(mag->count == 0 && !low) {
+        mag->count = buddy_cache_fill(&shared_arena.buddy, order, mag->refs, MAGAZINE_BATCH);
+        // Refills come out of the tree in address order.  Flip them so that
+        // the lowest addresses are handed out first, like without magazines
+        for(i = 0; i < mag->count / 2; i++) {
+            tmp = mag->refs[i];
+            mag->refs[i] = mag->refs[mag->count - 1 - i];
+            mag->refs[mag->count - 1 - i] = tmp;
+        }
+    }
+    if(mag->count > 0) {
+        ref = mag->refs[--mag->count];
+        magazine_tags[ref / shared_arena.buddy.block_size] = order + 1;
+    }
+    spin_unlock(&cache->lock);
+
+    // Only the first to see the tree run low drains, and only once the
+    // magazine's lock is dropped, since draining takes every one of them
+    if(low && !xchg(&arena_low, true)) {
+        drain_magazines();
+    }
+
+    return ref;
+}
+
+// Puts a block back in this CPU's magazine, draining half of the magazine to
+// the tree first if it is full.  0 on success, -1 if ref did not come from a magazine
+static int magazine_put(long ref) {
+    struct cpu_cache *cache;
+    struct magazine *mag;
+    int order;
+
+    if(!use_magazines() || ref < 0 || shared_arena.buddy.mem_size <= ref || ref % shared_arena.buddy.block_size) {
+        return -1;
+    }
+    order = xchg(&magazine_tags[ref / shared_arena.buddy.block_size], 0) - 1;
+    if(order < 0) {
+        return -1;
+    }
+    // The tree needs it more than the magazine does
+    if(READ_ONCE(arena_low)) {
+        buddy_cache_drain(&shared_arena.buddy, &ref, 1);
+        return 0;
+    }
+
+    cache = raw_cpu_ptr(&cpu_caches);
+    spin_lock(&cache->lock);
+    mag = &cache->mags[order];
+    if(mag->count == MAGAZINE_SIZE) {
+        buddy_cache_drain(&shared_arena.buddy, mag->refs, MAGAZINE_BATCH);
+        memmove(mag->refs, mag->refs + MAGAZINE_BATCH, (MAGAZINE_SIZE - MAGAZINE_BATCH) * sizeof(long));
+        mag->count -= MAGAZINE_BATCH;
+    }
+    mag->refs[mag->count++] = ref;
+    spin_unlock(&cache->lock);
+
+    return 0;
+}
+
+/// ----------------------------- STATISTICS ------------------------------ ///
+
+// Counters are per-CPU and only summed when someone reads
+// /sys/kernel/debug/buddy/stats, so leaving them on costs one local add each.
+// Splits, merges and free blocks per order come from the core instead (see
+// struct buddy_stats) and describe the shared arena only
+enum buddy_counter {
+    COUNT_ALLOCS,
+    COUNT_FREES,
+    COUNT_FAILED_ALLOCS,
+    COUNT_FAILED_FREES,
+    COUNT_BYTES_REQUESTED,
+    COUNT_BYTES_ALLOCATED,
+    COUNT_RECORDS_DROPPED,
+    NR_COUNTERS
+};
+
+static const char *const counter_names[NR_COUNTERS] = {
+    "allocations",
+    "frees",
+    "failed_allocations",
+    "failed_frees",
+    "bytes_requested",
+    "bytes_allocated",
+    "records_dropped"
+};
+
+struct buddy_counters {
+    unsigned long count[NR_COUNTERS];
+};
+
+static DEFINE_PER_CPU(struct buddy_counters, buddy_counters);
+
+static struct dentry *debug_dir;
+
+// Account for a get_mem of size bytes that returned ref, taking up allocated bytes
+static void count_get(long size, long allocated, long ref) {
+    if(ref < 0) {
+        this_cpu_inc(buddy_counters.count[COUNT_FAILED_ALLOCS]);
+        return;
+    }
+    this_cpu_inc(buddy_counters.count[COUNT_ALLOCS]);
+    this_cpu_add(buddy_counters.count[COUNT_BYTES_REQUESTED], max(size, 0L));
+    this_cpu_add(buddy_counters.count[COUNT_BYTES_ALLOCATED], allocated);
+}
+
+// Account for a free_mem that returned ret
+static void count_free(int ret) {
+    if(ret < 0) {
+        this_cpu_inc(buddy_counters.count[COUNT_FAILED_FREES]);
+    } else {
+        this_cpu_inc(buddy_counters.count[COUNT_FREES]);
+    }
+}
+
+// Prints x/y as a percentage with one decimal, without floating point
+static void seq_percent(struct seq_file *m, const char *name, unsigned long x, unsigned long y) {
+    unsigned long permille = y ? x * 1000 / y : 0;
+
+    seq_printf(m, "%-28s %lu.%lu%%\n", name, permille / 10, permille % 10);
+}
+
+static int stats_show(struct seq_file *m, void *v) {
+    unsigned long totals[NR_COUNTERS] = {0};
+    struct buddy_stats core;
+    unsigned long free_bytes = 0;
+    unsigned long largest = 0;
+    unsigned long size;
+    int cached[MAGAZINE_ORDERS] = {0};
+    int cpu;
+    int order;
+    int i;
+
+    for_each_possible_cpu(cpu) {
+        for(i = 0; i < NR_COUNTERS; i++) {
+            totals[i] += per_cpu(buddy_counters, cpu).count[i];
+        }
+        for(order = 0; order < MAGAZINE_ORDERS; order++) {
+            cached[order] += READ_ONCE(per_cpu(cpu_caches, cpu).mags[order].count);
+        }
+    }
+    for(i = 0; i < NR_COUNTERS; i++) {
+        seq_printf(m, "%-28s %lu\n", counter_names[i], totals[i]);
+    }
+    // How much of what was handed out was never asked for
+    seq_percent(m, "internal_fragmentation", totals[COUNT_BYTES_ALLOCATED] - totals[COUNT_BYTES_REQUESTED],
+        totals[COUNT_BYTES_ALLOCATED]);
+
+    buddy_get_stats(&shared_arena.buddy, &core);
+    seq_printf(m, "%-28s %lu\n", "splits", core.splits);
+    seq_printf(m, "%-28s %lu\n", "merges", core.merges);
+    seq_printf(m, "%-28s %lu\n", "coalesces", core.coalesces);
+    seq_printf(m, "%-28s %lu\n", "lock_contended", READ_ONCE(lock_contended));
+    seq_printf(m, "%-28s %d\n", "slabs", core.slabs);
+    seq_printf(m, "%-28s %d\n", "slab_objects", core.slab_objects);
+    for(order = 0; order <= shared_arena.buddy.depth; order++) {
+        size = (unsigned long)shared_arena.buddy.block_size << order;
+        seq_printf(m, "free_blocks[%2d] (%10lu B)    %d", order, size, core.free_blocks[order]);
+        if(order < MAGAZINE_ORDERS) {
+            seq_printf(m, " (+%d in magazines)", cached[order]);
+        }
+        seq_printf(m, "\n");
+        free_bytes += size * core.free_blocks[order];
+        if(core.free_blocks[order]) largest = size;
+    }
+    seq_printf(m, "%-28s %lu\n", "free_bytes", free_bytes);
+    seq_printf(m, "%-28s %lu\n", "largest_free_block", largest);
+    // How much of the free space can't be handed out in one piece
+    seq_percent(m, "external_fragmentation", free_bytes - largest, free_bytes);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+// Every ioctl is timed into a per-CPU log2 histogram, readable from
+// /sys/kernel/debug/buddy/latency.  Bucket b counts calls that took
+// [2^(b-1), 2^b) ns.  Costs two clock reads per call; histograms=0 turns it off
+static bool histograms = true;
+module_param(histograms, bool, 0644);
+MODULE_PARM_DESC(histograms, "Keep per-ioctl latency histograms in debugfs");
+
+enum latency_op {
+    LAT_GET_MEM,
+    LAT_FREE_MEM,
+    LAT_WRITE_MEM,
+    LAT_READ_MEM,
+    LAT_GET_MEM_BATCH,
+    LAT_FREE_MEM_BATCH,
+    LAT_WRITE_MEM_LEN,
+    LAT_WRITEV_MEM,
+    LAT_READV_MEM,
+    LAT_RING_ENTER,
+    LAT_REALLOC_MEM,
+    LAT_COMPACT,
+    LAT_RESET_ARENA,
+    NR_LAT_OPS
+};
+
+static const char *const latency_op_names[NR_LAT_OPS] = {
+    "get_mem",
+    "free_mem",
+    "write_mem",
+    "read_mem",
+    "get_mem_batch",
+    "free_mem_batch",
+    "write_mem_len",
+    "writev_mem",
+    "readv_mem",
+    "ring_enter",
+    "realloc_mem",
+    "compact",
+    "reset_arena"
+};
+
+#define LAT_BUCKETS 32
+
+struct latency_hist {
+    unsigned long count[NR_LAT_OPS][LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct latency_hist, latency_hists);
+
+static void record_latency(int op, u64 ns) {
+    this_cpu_inc(latency_hists.count[op][min(fls64(ns), LAT_BUCKETS - 1)]);
+}
+
+// Upper bound, in ns, of the bucket that holds the given fraction (in permille) of calls
+static unsigned long long latency_percentile(unsigned long *buckets, unsigned long total, int permille) {
+    unsigned long seen = 0;
+    int b;
+
+    for(b = 0; b < LAT_BUCKETS; b++) {
+        seen += buckets[b];
+        if(seen * 1000 >= total * permille) break;
+    }
+
+    return 1ULL << min(b, LAT_BUCKETS - 1);
+}
+
+static int latency_show(struct seq_file *m, void *v) {
+    unsigned long buckets[LAT_BUCKETS];
+    unsigned long total;
+    int cpu;
+    int op;
+    int b;
+
+    for(op = 0; op < NR_LAT_OPS; op++) {
+        total = 0;
+        for(b = 0; b < LAT_BUCKETS; b++) {
+            buckets[b] = 0;
+            for_each_possible_cpu(cpu) {
+                buckets[b] += per_cpu(latency_hists, cpu).count[op][b];
+            }
+            total += buckets[b];
+        }
+        if(total == 0) continue;
+
+        seq_printf(m, "%s: %lu calls, p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns\n",
+            latency_op_names[op], total, latency_percentile(buckets, total, 500),
+            latency_percentile(buckets, total, 990), latency_percentile(buckets, total, 999));
+        for(b = 0; b < LAT_BUCKETS; b++) {
+            if(buckets[b] == 0) continue;
+            seq_printf(m, "    [%10llu, %10llu) ns  %lu\n", b ? 1ULL << (b - 1) : 0, 1ULL << b, buckets[b]);
+        }
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/// ------------------------------ RECORDING ------------------------------- ///
+
+// With record=1, every get and free on the shared arena is logged as a struct
+// buddy_record (see buddy-dev.h) so that a real workload can be replayed
+// offline.  Each CPU logs into a ring of its own, which only it writes (with
+// preemption off) and only the reader of debugfs buddy/trace consumes, so no
+// lock is taken on either side: the writer publishes head after filling a
+// record, the reader publishes tail after copying records out.  When a ring
+// is full its records are dropped (and counted), never overwritten
+static bool record = false;
+module_param(record, bool, 0444);
+MODULE_PARM_DESC(record, "Log every get and free on the shared arena to debugfs buddy/trace");
+
+#define RECORD_RING_SIZE (1<<16) // Records per CPU, a power of two
+
+struct record_ring {
+    struct buddy_record *records;
+    unsigned long head; // Written by the ring's CPU
+    unsigned long tail; // Written by the reader
+};
+
+static DEFINE_PER_CPU(struct record_ring, record_rings);
+
+// Only one reader at a time may move the tails
+static DEFINE_MUTEX(record_read_lock);
+
+// Logs one operation by mf on ma, if ma is the shared arena and recording is on
+static void record_op(struct mem_arena *ma, struct mem_file *mf, int op, long size, long ref, long arg) {
+    struct record_ring *rr;
+    struct buddy_record *rec;
+    unsigned long head;
+
+    if(!record || ma != &shared_arena) {
+        return;
+    }
+
+    rr = get_cpu_ptr(&record_rings);
+    head = rr->head;
+    if(head - smp_load_acquire(&rr->tail) >= RECORD_RING_SIZE) {
+        this_cpu_inc(buddy_counters.count[COUNT_RECORDS_DROPPED]);
+    } else {
+        rec = &rr->records[head & (RECORD_RING_SIZE - 1)];
+        rec->time_ns = ktime_get_ns();
+        rec->op = op;
+        rec->owner = mf->owner;
+        rec->size = size;
+        rec->ref = ref;
+        rec->arg = arg;
+        rec->cpu = smp_processor_id();
+        smp_store_release(&rr->head, head + 1);
+    }
+    put_cpu_ptr(&record_rings);
+}
+
+// Copies out (and consumes) as many whole records as fit in length bytes,
+// going through the CPUs in turn
+static ssize_t trace_read(struct file *file, char *buf, size_t length, loff_t *offset) {
+    struct record_ring *rr;
+    unsigned long head;
+    unsigned long tail;
+    size_t room = length / sizeof(struct buddy_record);
+    size_t done = 0;
+    size_t n;
+    int cpu;
+
+    mutex_lock(&record_read_lock);
+    for_each_possible_cpu(cpu) {
+        rr = per_cpu_ptr(&record_rings, cpu);
+        head = smp_load_acquire(&rr->head);
+        for(tail = rr->tail; tail != head && done < room; tail += n, done += n) {
+            // Up to the end of the ring at most, then around again
+            n = min3((size_t)(head - tail), room - done,
+                     (size_t)(RECORD_RING_SIZE - (tail & (RECORD_RING_SIZE - 1))));
+            if(copy_to_user(buf + done * sizeof(struct buddy_record),
+                            &rr->records[tail & (RECORD_RING_SIZE - 1)], n * sizeof(struct buddy_record))) {
+                smp_store_release(&rr->tail, tail);
+                mutex_unlock(&record_read_lock);
+                return done ? done * sizeof(struct buddy_record) : -EFAULT;
+            }
+        }
+        smp_store_release(&rr->tail, tail);
+    }
+    mutex_unlock(&record_read_lock);
+
+    return done * sizeof(struct buddy_record);
+}
+
+static const struct file_operations trace_fops = {
+    .owner = THIS_MODULE,
+    .read = trace_read,
+    .llseek = noop_llseek
+};
+
+static int setup_record_rings(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        per_cpu_ptr(&record_rings, cpu)->records = vmalloc(RECORD_RING_SIZE * sizeof(struct buddy_record));
+        if(!per_cpu_ptr(&record_rings, cpu)->records) {
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+static void teardown_record_rings(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        vfree(per_cpu_ptr(&record_rings, cpu)->records);
+        per_cpu_ptr(&record_rings, cpu)->records = NULL;
+    }
+}
+
+/// -------------------------------- OWNERS -------------------------------- ///
+
+// Every block handed out from the shared arena is tagged with the owner id of
+// the file handle that asked for it.  Blocks, and the first object of each
+// slab, start on a multiple of the block size and get one tag per block.
+// Other slab objects are few next to the arena and are looked up by ref in
+// object_owners instead, so slabs don't shrink the tag granularity.  Only the
+// owner can free or resize a block, and whatever it still holds when it is
+// closed is freed in bulk.  Private arenas need none of this: they go away
+// whole when their handle is closed
+static u32 *block_owners;
+static int owner_shift; // log2 of the block size
+static DEFINE_XARRAY(object_owners);
+static DEFINE_IDA(owner_ida);
+
+// Who holds ref in the shared arena, 0 if nobody (or ref is no block or object)
+static u32 ref_owner(long ref) {
+    void *entry;
+
+    if(ref < 0 || shared_arena.buddy.mem_size <= ref) {
+        return 0;
+    }
+    if(!(ref & ((1L << owner_shift) - 1))) {
+        return READ_ONCE(block_owners[ref >> owner_shift]);
+    }
+    entry = xa_load(&object_owners, ref);
+
+    return entry ? xa_to_value(entry) : 0;
+}
+
+// Tags ref, if it is one, as mf's.  Returns ref, or -1 if there was no memory
+// for the tag, in which case ref goes back to the arena
+static long own_ref(struct mem_arena *ma, struct mem_file *mf, long ref) {
+    if(ma != &shared_arena || ref < 0) {
+        return ref;
+    }
+    if(!(ref & ((1L << owner_shift) - 1))) {
+        WRITE_ONCE(block_owners[ref >> owner_shift], mf->owner);
+    } else if(xa_err(xa_store(&object_owners, ref, xa_mk_value(mf->owner), GFP_KERNEL))) {
+        buddy_free_mem(&ma->buddy, ref);
+        return -1;
+    }
+    atomic_inc(&mf->owned);
+
+    return ref;
+}
+
+// A tag no handle has.  realloc_mem puts it on a block while working on it,
+// so that nobody, the block's owner included, can free it meanwhile
+#define OWNER_BUSY U32_MAX
+
+// Retags ref in the shared arena from from to to (0 for nobody), if it is
+// tagged from.  Whether it was.  Only the swap decides, so two racing callers
+// can't both win
+static bool swap_owner(long ref, u32 from, u32 to) {
+    void *tag = xa_mk_value(from);
+
+    if(ref < 0 || shared_arena.buddy.mem_size <= ref) {
+        return false;
+    }
+    if(!(ref & ((1L << owner_shift) - 1))) {
+        return cmpxchg(&block_owners[ref >> owner_shift], from, to) == from;
+    }
+
+    return xa_cmpxchg(&object_owners, ref, tag, to ? xa_mk_value(to) : NULL, GFP_KERNEL) == tag;
+}
+
+// Takes mf's tag off ref, so that it can be freed.  0 on success, -1 if ref
+// is not mf's.  The swap makes sure two frees of one block can't both get here
+static int disown_ref(struct mem_arena *ma, struct mem_file *mf, long ref) {
+    if(ma != &shared_arena) {
+        return 0;
+    }
+    if(!swap_owner(ref, mf->owner, 0)) {
+        return -1;
+    }
+    atomic_dec(&mf->owned);
+
+    return 0;
+}
+
+// Whether ref is a block in the shared arena that another handle than mf holds
+static bool foreign_ref(struct mem_arena *ma, struct mem_file *mf, long ref) {
+    u32 owner;
+
+    if(ma != &shared_arena) {
+        return false;
+    }
+    owner = ref_owner(ref);
+
+    return owner != 0 && owner != mf->owner;
+}
+
+/// ------------------------------------------------------------------------ ///
+
+// Given a memory size, give a reference to that block.
+// Returns a -1 if the request could not be satisfied
+long get_mem(struct mem_arena *ma, struct mem_file *mf, long size) {
+    long ref;
+
+    if(handle_arena(ma)) {
+        ref = buddy_get_handle(&ma->buddy, size);
+        count_get(size, (long)ma->buddy.block_size << max(buddy_size_to_order(&ma->buddy, size), 0), ref);
+        return ref;
+    }
+    if(ma != &shared_arena) {
+        ref = buddy_get_mem(&ma->buddy, size);
+        count_get(size, buddy_alloc_size(&ma->buddy, size), ref);
+        return ref;
+    }
+
+    ref = magazine_get(size);
+    if(ref < 0) {
+        ref = buddy_get_mem(&ma->buddy, size);
+    }
+    if(ref < 0 && use_magazines()) {
+        drain_magazines();
+        ref = buddy_get_mem(&ma->buddy, size);
+    }
+    ref = own_ref(ma, mf, ref);
+    count_get(size, buddy_alloc_size(&ma->buddy, size), ref);
+    record_op(ma, mf, BUDDY_RECORD_GET, size, ref, 0);
+
+    return ref;
+}
+
+// Like get_mem, but the ref is a multiple of align.  Never served from
+// magazines, whose blocks are only aligned to their own size
+long get_mem_aligned(struct mem_arena *ma, struct mem_file *mf, long size, long align) {
+    long ref;
+
+    if(handle_arena(ma)) {
+        return -1;
+    }
+
+    ref = buddy_get_mem_aligned(&ma->buddy, size, align);
+    if(ref < 0 && ma == &shared_arena && use_magazines()) {
+        drain_magazines();
+        ref = buddy_get_mem_aligned(&ma->buddy, size, align);
+    }
+    ref = own_ref(ma, mf, ref);
+    count_get(size, buddy_alloc_size(&ma->buddy, size), ref);
+    record_op(ma, mf, BUDDY_RECORD_GET_ALIGNED, size, ref, align);
+
+    return ref;
+}
+
+// Like get_mem, but the unneeded tail of the block goes back to the arena.
+// Never served from magazines, which only hold whole blocks
+long get_mem_exact(struct mem_arena *ma, struct mem_file *mf, long size) {
+    long ref;
+
+    if(handle_arena(ma)) {
+        return -1;
+    }
+
+    ref = buddy_get_mem_exact(&ma->buddy, size);
+    if(ref < 0 && ma == &shared_arena && use_magazines()) {
+        drain_magazines();
+        ref = buddy_get_mem_exact(&ma->buddy, size);
+    }
+    ref = own_ref(ma, mf, ref);
+    count_get(size, round_up(max(size, 1L), (long)ma->buddy.block_size), ref);
+    record_op(ma, mf, BUDDY_RECORD_GET_EXACT, size, ref, 0);
+
+    return ref;
+}
+
+// Gives ref, which nobody holds any more, back to the arena.  0 on success, -1 on failure
+static int release_ref(struct mem_arena *ma, struct mem_file *mf, long ref) {
+    int ret;
+
+    if(ma == &shared_arena && magazine_put(ref) == 0) {
+        ret = 0;
+    } else {
+        ret = buddy_free_mem(&ma->buddy, ref);
+    }
+    count_free(ret);
+    if(ret == 0) {
+        record_op(ma, mf, BUDDY_RECORD_FREE, 0, ref, 0);
+    }
+
+    return ret;
+}
+
+// Frees memory.  0 on success, -1 on failure
+int free_mem(struct mem_arena *ma, struct mem_file *mf, long ref) {
+    int ret;
+
+    if(handle_arena(ma)) {
+        ret = ref == (int)ref ? buddy_free_handle(&ma->buddy, ref) : -1;
+    } else if(disown_ref(ma, mf, ref) < 0) {
+        ret = -1;
+    } else {
+        return release_ref(ma, mf, ref);
+    }
+    count_free(ret);
+    if(ret == 0) {
+        record_op(ma, mf, BUDDY_RECORD_FREE, 0, ref, 0);
+    }
+
+    return ret;
+}
+
+// Resizes the block at ref to size bytes: in place if the core can, else by
+// moving the data to a new block inside the kernel.  Returns the (possibly new)
+// ref, or -1 if ref is not an allocation or no block of size bytes could be
+// had, in which case ref is left alone
+long realloc_mem(struct mem_arena *ma, struct mem_file *mf, long ref, long size) {
+    long new_ref = -1;
+    long start;
+    long old_size;
+    int ret;
+
+    if(handle_arena(ma)) {
+        return -1;
+    }
+    // In the shared arena, ref is tagged busy from the ownership check until
+    // it is freed or handed back, so that it can't be freed (and got by
+    // someone else) while it is resized
+    if(ma == &shared_arena && !swap_owner(ref, mf->owner, OWNER_BUSY)) {
+        return -1;
+    }
+
+    // A move is recorded as the get and free it is made of
+    ret = buddy_resize(&ma->buddy, ref, size);
+    if(ret == 0) {
+        record_op(ma, mf, BUDDY_RECORD_RESIZE, size, ref, 0);
+        new_ref = ref;
+    } else if(ret > 0 && buddy_block_bounds(&ma->buddy, ref, &start, &old_size) == 0) {
+        new_ref = get_mem(ma, mf, size);
+    }
+    if(new_ref < 0 || new_ref == ref) {
+        if(ma == &shared_arena) {
+            swap_owner(ref, OWNER_BUSY, mf->owner);
+        }
+        return new_ref;
+    }
+    memcpy(ma->memory + new_ref, ma->memory + ref, min(old_size, max(size, 0L)));
+
+    if(ma == &shared_arena) {
+        swap_owner(ref, OWNER_BUSY, 0);
+        atomic_dec(&mf->owned);
+    }
+    if(release_ref(ma, mf, ref) < 0) {
+        free_mem(ma, mf, new_ref);
+        return -1;
+    }
+
+    return new_ref;
+}
+
+/// ------------------------------------------------------------------------ ///
+
+static void teardown_ring(struct mem_ring *mr);
+static void free_owned(struct mem_file *mf);
+
+static int open(struct inode *inode, struct file *file) {
+    struct mem_file *mf;
+    int ret;
+
+    printk("----open(...)\n");
+
+    mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+    if(!mf) {
+        return -ENOMEM;
+    }
+    // 0 is what free blocks are tagged with
+    ret = ida_alloc_min(&owner_ida, 1, GFP_KERNEL);
+    if(ret < 0) {
+        kfree(mf);
+        return ret;
+    }
+    mf->owner = ret;
+    file->private_data = mf;
+
+    return 0;
+}
+
+static int release(struct inode *inode, struct file *file) {
+    struct mem_file *mf = file->private_data;
+
+    printk("----release(...)\n");
+
+    // Any mapping of a private arena or of the ring holds a reference to the
+    // file, so by now nothing can still be looking at their memory
+    if(mf->ring) {
+        teardown_ring(mf->ring);
+    }
+    if(mf->arena == &shared_arena) {
+        free_owned(mf);
+    } else if(mf->arena) {
+        teardown_arena(mf->arena);
+        kfree(mf->arena);
+    }
+    ida_free(&owner_ida, mf->owner);
+    kfree(mf);
+
+    return 0;
+}
+
+// read(2) and write(2) see the arena's bytes as a file of mem_size bytes.
+// Reads stop at its end, and writes past it fail with ENOSPC.  Blocks of a
+// handle arena are held still meanwhile, as for IOCTL_READ_MEM
+static ssize_t rw_file(struct file *file, char *buffer, size_t length, loff_t *offset, bool writing) {
+    struct mem_arena *ma = file_arena(file);
+    unsigned long left;
+
+    if(*offset < 0) {
+        return -EINVAL;
+    }
+    if(*offset >= ma->buddy.mem_size) {
+        return writing && length ? -ENOSPC : 0;
+    }
+    length = min_t(size_t, length, ma->buddy.mem_size - *offset);
+
+    hold_refs(ma);
+    if(writing) {
+        left = copy_from_user(ma->memory + *offset, buffer, length);
+    } else {
+        left = copy_to_user(buffer, ma->memory + *offset, length);
+    }
+    release_refs(ma);
+    if(left) {
+        return -EFAULT;
+    }
+    *offset += length;
+
+    return length;
+}
+
+static ssize_t read(struct file *file, char *buffer, size_t length, loff_t *offset) {
+    return rw_file(file, buffer, length, offset, false);
+}
+
+static ssize_t write(struct file *file, const char *buffer, size_t length, loff_t *offset) {
+    return rw_file(file, (char *)buffer, length, offset, true);
+}
+
+// Maps the arena into the caller's address space.  A ref returned by get_mem is
+// then just an offset into the mapping, so no ioctl is needed to touch the data.
+// Mapping at BUDDY_RING_OFFSET gives the handle's rings instead
+static int mmap(struct file *file, struct vm_area_struct *vma) {
+    struct mem_ring *mr = READ_ONCE(((struct mem_file *)file->private_data)->ring);
+
+    printk("----mmap(...)\n");
+
+    if(vma->vm_pgoff == BUDDY_RING_OFFSET >> PAGE_SHIFT) {
+        return mr ? remap_vmalloc_range(vma, mr->shared, 0) : -EINVAL;
+    }
+
+    // remap_vmalloc_range refuses anything larger than the (page aligned) arena
+    return remap_vmalloc_range(vma, file_arena(file)->memory, vma->vm_pgoff);
+}
+
+/// -------------- Some more buddy allocator wrapper functions ------------- ///
+
+// Writes to memory.  Num bytes written on success, -1 on failure
+long write_mem(struct file *file, long ref, char *buf) {
+    struct mem_arena *ma = file_arena(file);
+    long ret = -1;
+    long size;
+
+    // buf is a user pointer, so it has to be measured with strnlen_user.
+    // That counts the terminating zero, and returns 0 if buf is bad
+    size = strnlen_user(buf, ma->buddy.mem_size + 1) - 1;
+    if(size < 0) {
+        return -1;
+    }
+
+    // Sanity check -- if the start and end are not in the same block
+    // then there is an error
+    hold_refs(ma);
+    ref = resolve_ref(ma, ref);
+    if(buddy_check_range(&ma->buddy, ref, size) == 0) {
+        ret = write(file, buf, size, (loff_t *)ref);
+    }
+    release_refs(ma);
+
+    return ret;
+}
+
+// Reads from memory.  Num bytes read on success, -1 on failure
+long read_mem(struct file *file, long ref, char *buf, long size) {
+    struct mem_arena *ma = file_arena(file);
+    long ret = -1;
+
+    // Sanity check -- if the start and end are not in the same block
+    // then there is an error
+    hold_refs(ma);
+    ref = resolve_ref(ma, ref);
+    if(buddy_check_range(&ma->buddy, ref, size) == 0) {
+        ret = read(file, buf, size, (loff_t *)ref);
+    }
+    release_refs(ma);
+
+    return ret;
+}
+
+// Writes exactly size bytes from buf to memory, zeros included.
+// Num bytes written on success, -1 on failure
+long write_mem_len(struct file *file, long ref, char *buf, long size) {
+    struct mem_arena *ma = file_arena(file);
+    long ret = -1;
+
+    hold_refs(ma);
+    ref = resolve_ref(ma, ref);
+    if(buddy_check_range(&ma->buddy, ref, size) == 0 && !copy_from_user(ma->memory + ref, buf, size)) {
+        ret = size;
+    }
+    release_refs(ma);
+
+    return ret;
+}
+
+// Segments are copied in from user space this many at a time
+#define IOV_CHUNK 16
+
+// Moves every segment of iov[0..count) into memory (writing) or out of it.
+// Each segment is checked against the bounds of its block with a single lookup.
+// Total bytes moved on success, -1 at the first bad segment
+static int __rw_mem_vec(struct mem_arena *ma, struct mem_iovec *iov, int count, bool writing) {
+    struct mem_iovec kiov[IOV_CHUNK];
+    struct mem_iovec *seg;
+    char *data;
+    long moved = 0;
+    long ref;
+    long start;
+    long block_size;
+    int done;
+    int n;
+    int i;
+
+    for(done = 0; done < count; done += n) {
+        n = min(count - done, IOV_CHUNK);
+        if(copy_from_user(kiov, iov + done, n * sizeof(struct mem_iovec))) {
+            return -1;
+        }
+        for(i = 0; i < n; i++) {
+            seg = &kiov[i];
+            if(seg->offset < 0 || seg->len < 0) {
+                return -1;
+            }
+            ref = resolve_ref(ma, seg->ref);
+            if(buddy_block_bounds(&ma->buddy, ref, &start, &block_size) < 0) {
+                return -1;
+            }
+            if(ref + seg->offset + seg->len > start + block_size) {
+                return -1;
+            }
+
+            data = ma->memory + ref + seg->offset;
+            if(writing ? copy_from_user(data, seg->buf, seg->len) : copy_to_user(seg->buf, data, seg->len)) {
+                return -1;
+            }
+            moved += seg->len;
+        }
+    }
+
+    return min(moved, (long)INT_MAX);
+}
+
+int rw_mem_vec(struct file *file, struct mem_iovec *iov, int count, bool writing) {
+    struct mem_arena *ma = file_arena(file);
+    int ret;
+
+    hold_refs(ma);
+    ret = __rw_mem_vec(ma, iov, count, writing);
+    release_refs(ma);
+
+    return ret;
+}
+
+// Batches are copied in and out of user space this many entries at a time
+#define BATCH_CHUNK 64
+
+// Allocates sizes[0..count) into refs[0..count).  Num successful allocations
+// on success, -1 in a handle arena or if the arrays could not be accessed
+int get_mem_batch(struct mem_arena *ma, struct mem_file *mf, int *sizes, int *refs, int count) {
+    int kbuf[BATCH_CHUNK];
+    long ksizes[BATCH_CHUNK];
+    long krefs[BATCH_CHUNK];
+    int succeeded = 0;
+    int done;
+    int n;
+    int i;
+
+    if(handle_arena(ma)) {
+        return -1;
+    }
+    for(done = 0; done < count; done += n) {
+        n = min(count - done, BATCH_CHUNK);
+        // The core takes longs, user space passes ints
+        if(copy_from_user(kbuf, sizes + done, n * sizeof(int))) {
+            return -1;
+        }
+        for(i = 0; i < n; i++) {
+            ksizes[i] = kbuf[i];
+        }
+        buddy_get_mem_batch(&ma->buddy, ksizes, krefs, n);
+
+        // As in get_mem, what the tree can't give may be sitting in magazines
+        for(i = 0; i < n && krefs[i] >= 0; i++);
+        if(i < n && ma == &shared_arena && use_magazines()) {
+            drain_magazines();
+            for(; i < n; i++) {
+                if(krefs[i] < 0) krefs[i] = buddy_get_mem(&ma->buddy, ksizes[i]);
+            }
+        }
+        for(i = 0; i < n; i++) {
+            kbuf[i] = krefs[i] = own_ref(ma, mf, krefs[i]);
+            succeeded += krefs[i] >= 0;
+            count_get(ksizes[i], buddy_alloc_size(&ma->buddy, ksizes[i]), krefs[i]);
+            record_op(ma, mf, BUDDY_RECORD_GET, ksizes[i], krefs[i], 0);
+        }
+        if(copy_to_user(refs + done, kbuf, n * sizeof(int))) {
+            return -1;
+        }
+    }
+
+    return succeeded;
+}
+
+// Frees refs[0..count), storing each result in results[0..count) if results is not NULL.
+// Num blocks freed on success, -1 in a handle arena or if the arrays could not be accessed
+int free_mem_batch(struct mem_arena *ma, struct mem_file *mf, int *refs, int *results, int count) {
+    int krefs[BATCH_CHUNK];
+    int kresults[BATCH_CHUNK];
+    long tree_refs[BATCH_CHUNK];
+    int tree_results[BATCH_CHUNK];
+    int tree_idx[BATCH_CHUNK];
+    int freed = 0;
+    int done;
+    int n;
+    int t;
+    int i;
+
+    if(handle_arena(ma)) {
+        return -1;
+    }
+    for(done = 0; done < count; done += n) {
+        n = min(count - done, BATCH_CHUNK);
+        if(copy_from_user(krefs, refs + done, n * sizeof(int))) {
+            return -1;
+        }
+        // Blocks the handle doesn't own are refused.  Blocks that came from a
+        // magazine go back to one, the rest are freed to the tree together
+        t = 0;
+        for(i = 0; i < n; i++) {
+            if(disown_ref(ma, mf, krefs[i]) < 0) {
+                kresults[i] = -1;
+            } else if(ma == &shared_arena && magazine_put(krefs[i]) == 0) {
+                kresults[i] = 0;
+                freed++;
+            } else {
+                tree_idx[t] = i;
+                tree_refs[t++] = krefs[i];
+            }
+        }
+        freed += buddy_free_mem_batch(&ma->buddy, tree_refs, tree_results, t);
+        for(i = 0; i < t; i++) {
+            kresults[tree_idx[i]] = tree_results[i];
+        }
+        for(i = 0; i < n; i++) {
+            count_free(kresults[i]);
+            if(kresults[i] == 0) {
+                record_op(ma, mf, BUDDY_RECORD_FREE, 0, krefs[i], 0);
+            }
+        }
+        if(results && copy_to_user(results + done, kresults, n * sizeof(int))) {
+            return -1;
+        }
+    }
+
+    return freed;
+}
+
+// free_owned's part for one ref it took mf's tag off.  Goes to a magazine if
+// one takes it, else into refs[0..*n), which is freed once full.  Num blocks freed
+static int free_disowned(struct mem_file *mf, long ref, long *refs, int *n) {
+    int freed;
+
+    atomic_dec(&mf->owned);
+    record_op(&shared_arena, mf, BUDDY_RECORD_FREE, 0, ref, 0);
+    if(magazine_put(ref) == 0) {
+        return 1;
+    }
+    refs[(*n)++] = ref;
+    if(*n < BATCH_CHUNK) {
+        return 0;
+    }
+    freed = buddy_free_mem_batch(&shared_arena.buddy, refs, NULL, *n);
+    *n = 0;
+
+    return freed;
+}
+
+// Frees every block in the shared arena that mf still holds, in batches.
+// Nothing to look for if it holds none, else one pass over the block tags
+// and the slab objects, cut short as soon as the last of them is found
+static void free_owned(struct mem_file *mf) {
+    long refs[BATCH_CHUNK];
+    long num_tags = shared_arena.buddy.mem_size >> owner_shift;
+    unsigned long index;
+    void *entry;
+    long i;
+    int freed = 0;
+    int n = 0;
+
+    if(atomic_read(&mf->owned) == 0) {
+        return;
+    }
+    for(i = 0; i < num_tags && atomic_read(&mf->owned) > 0; i++) {
+        if(READ_ONCE(block_owners[i]) == mf->owner) {
+            block_owners[i] = 0;
+            freed += free_disowned(mf, i << owner_shift, refs, &n);
+        }
+    }
+    xa_for_each(&object_owners, index, entry) {
+        if(atomic_read(&mf->owned) == 0) {
+            break;
+        }
+        if(xa_to_value(entry) == mf->owner) {
+            xa_erase(&object_owners, index);
+            freed += free_disowned(mf, index, refs, &n);
+        }
+    }
+    freed += buddy_free_mem_batch(&shared_arena.buddy, refs, NULL, n);
+    this_cpu_add(buddy_counters.count[COUNT_FREES], freed);
+}
+
+// Gives the file handle an arena of its own, of size bytes in blocks of bsize
+// bytes, with BUDDY_ARENA_* flags and a BUDDY_POLICY_* placement policy.  Only
+// possible before the handle's first allocation.  0 on success, or a -errno
+static int __create_arena(struct file *file, long size, int bsize, int flags, int placement) {
+    struct mem_file *mf = file->private_data;
+    struct mem_arena *ma;
+    long footprint;
+    int ret;
+
+    if(READ_ONCE(mf->arena) || bsize <= 0 || size < bsize || (flags & ~BUDDY_ARENA_HANDLES)) {
+        return -EINVAL;
+    }
+    footprint = arena_footprint(size, bsize, flags & BUDDY_ARENA_HANDLES, slabs);
+    if(footprint < 0 || footprint > max_private_size) {
+        return -EINVAL;
+    }
+    // Handles and ring entries are ints, and have no 64-bit ioctls to fall back on
+    if(size > INT_MAX && ((flags & BUDDY_ARENA_HANDLES) || READ_ONCE(mf->ring))) {
+        return -EOVERFLOW;
+    }
+
+    ma = kzalloc(sizeof(*ma), GFP_KERNEL);
+    if(!ma) {
+        return -ENOMEM;
+    }
+    ret = setup_arena(ma, size, bsize, placement, &buddy_private_hooks);
+    if(ret < 0) {
+        kfree(ma);
+        return ret;
+    }
+    if((flags & BUDDY_ARENA_HANDLES) && buddy_enable_handles(&ma->buddy) < 0) {
+        teardown_arena(ma);
+        kfree(ma);
+        return -ENOMEM;
+    }
 
-// Here is the root of our tree
-static struct block_node *buddy_root;
+    // Someone else may have allocated on this handle (or created an arena)
+    // in the meantime, in which case they win
+    if(cmpxchg(&mf->arena, NULL, ma) != NULL) {
+        teardown_arena(ma);
+        kfree(ma);
+        return -EINVAL;
+    }
 
-// Called on buddy_root when module is unloaded to free an entire tree
-static void free_tree(struct block_node *block) {
-    if(block->left_child) free_tree(block->left_child);
-    if(block->right_child) free_tree(block->right_child);
-    kfree(block);
+    return 0;
 }
 
-// Given a block, splits it into two buddies
-static void __split_block(struct block_node *block) {
-    block->state = PARENT;
-
-    block->left_child = kmalloc(sizeof(struct block_node), GFP_KERNEL);
-    block->left_child->state = FREE;
-    block->left_child->parent = block;
-    block->left_child->left_child = NULL;
-    block->left_child->right_child = NULL;
+// __create_arena for the original ABI.  0 on success, -1 on failure
+int create_arena(struct file *file, int size, int bsize, int flags, int placement) {
+    return __create_arena(file, size, bsize, flags, placement) < 0 ? -1 : 0;
+}
 
-    block->right_child = kmalloc(sizeof(struct block_node), GFP_KERNEL);
-    block->right_child->state = FREE;
-    block->right_child->parent = block;
-    block->right_child->left_child = NULL;
-    block->right_child->right_child = NULL;
+// The offset of the block behind handle, or -1 if there is no such handle
+// (or the arena has no handles).  Only good until the next compaction
+long resolve_handle(struct mem_arena *ma, int handle) {
+    return handle_arena(ma) ? buddy_handle_ref(&ma->buddy, handle) : -1;
 }
 
-// Given a leaf node, make it free and attempt to merge it with it's buddy
-static void __free_and_merge(struct block_node *block) {
-    struct block_node *parent;
+// Blocks are moved this many at a time
+#define COMPACT_CHUNK 16
 
-    block->state = FREE;
-    parent = block->parent;
+// The moves one buddy_compact call decided on.  The tree is updated under the
+// arena's spinlock, but the data is only copied once that has been dropped:
+// compact_lock is held for writing throughout, which keeps out everything
+// that looks at a handle's data, so nobody can see a block before it arrives
+struct compact_plan {
+    int n;
+    struct {
+        long dst;
+        long src;
+        long size;
+    } moves[COMPACT_CHUNK];
+};
 
-    if(parent && parent->left_child->state == FREE && parent->right_child->state == FREE) {
-        // If the parent exists it is guaranteed to have
-        // both a left and right child so this is valid.
-        // Another invariant is that block==parent->left_child || block==parent->right_child
-        kfree(parent->left_child);
-        kfree(parent->right_child);
-        parent->left_child = NULL;
-        parent->right_child = NULL;
-        __free_and_merge(parent);
-    }
+static void compact_move(void *ctx, long dst, long src, long size) {
+    struct compact_plan *plan = ctx;
+
+    plan->moves[plan->n].dst = dst;
+    plan->moves[plan->n].src = src;
+    plan->moves[plan->n].size = size;
+    plan->n++;
 }
 
-// Given an address, get the block pointer for the
-// block that contains the memory at that address.
-// Returns NULL if ref is out of range
-struct block_node *__get_block_from_address(int ref) {
-    int block_idx;
-    int nth_bit;
+// Moves up to max_moves blocks (no limit if max_moves <= 0) of a handle arena
+// toward its start.  Num blocks moved, -1 if the arena has no handles
+int compact_arena(struct mem_arena *ma, int max_moves) {
+    struct compact_plan plan;
+    int moved = 0;
     int n;
-    struct block_node *current_node;
-
-    if(ref < 0 || MEM_SIZE <= ref) return NULL;
-
-    // The binary representation of the block index (block_idx) from right to left,
-    // starting at the BUDDY_BLOCK_DEPTH bit, will tell us whether the node we are
-    // looking for is in the right or left half of the tree
-    block_idx = ref / BUDDY_BLOCK_SIZE;
-    current_node = buddy_root;
-    for(n = BUDDY_BLOCK_DEPTH-1; n >= 0; n--) {
-        // If the current node is not a leaf, then we already found our block pointer
-        if(current_node->state != PARENT) {
-            break;
+    int i;
+
+    if(!handle_arena(ma)) {
+        return -1;
+    }
+
+    // Every move leaves a block at a lower offset than before, so this ends.
+    // A later move may land where an earlier one left, so they are made in order
+    down_write(&ma->compact_lock);
+    while(max_moves <= 0 || moved < max_moves) {
+        n = max_moves <= 0 ? COMPACT_CHUNK : min(COMPACT_CHUNK, max_moves - moved);
+        plan.n = 0;
+        n = buddy_compact(&ma->buddy, n, compact_move, &plan);
+        for(i = 0; i < plan.n; i++) {
+            memmove(ma->memory + plan.moves[i].dst, ma->memory + plan.moves[i].src, plan.moves[i].size);
+            cond_resched();
         }
-        nth_bit = (block_idx >> n) & 1;
-        // If 1, go right; else go left
-        if(nth_bit) {
-            current_node = current_node->right_child;
-        } else {
-            current_node = current_node->left_child;
+        if(n == 0) {
+            break;
         }
+        moved += n;
     }
+    up_write(&ma->compact_lock);
 
-    return current_node;
+    return moved;
 }
 
-// Given a memory size, give a reference to that block.
-// Returns a -1 if the request could not be satisfied
-int get_mem(int size, struct block_node *block, int available) {
-    int ref;
-    ref = 0;
-
-    // Case: user has requested more memory than is available
-    if(available < size) {
+// Frees everything in a private arena at once.  0 on success, -1 for the
+// shared arena, which is not the handle's alone to reset
+int reset_arena(struct mem_arena *ma) {
+    if(ma == &shared_arena) {
         return -1;
     }
-    // Case: the current block is free and has enough memory
-    if(block->state == FREE) {
-        // Inner case: the current block is too big so we split it into buddies
-        if(size <= (available>>1) && BUDDY_BLOCK_SIZE <= (available>>1)) {
-            __split_block(block);
-            return get_mem(size, block->left_child, available>>1);
-        }
-        // Inner case: the current block is already the proper size
-        block->state = ALLOCATED;
-        return 0;
+
+    // Nobody may be in the middle of touching a handle's block
+    if(handle_arena(ma)) {
+        down_write(&ma->compact_lock);
     }
-    // Case: the current block is allocated
-    if(block->state == ALLOCATED) {
-        return -1;
+    buddy_reset(&ma->buddy);
+    if(handle_arena(ma)) {
+        up_write(&ma->compact_lock);
     }
-    // Case: the current block node is not a leaf
-    // Step 1: scan the left tree for open space and return if we found some
-    ref = get_mem(size, block->left_child, available>>1);
-    if(ref >= 0) {
-        return ref;
+
+    return 0;
+}
+
+// Copies a snapshot of the arena (see struct snapshot_arena_struct) into buf,
+// or just sizes it if buf is NULL.  The snapshot's size, or -1
+long snapshot_arena(struct mem_arena *ma, char *buf, long size) {
+    void *state;
+    long data_offset;
+    long ret = -1;
+
+    // Cached blocks would come back as allocated ones, and nobody would own them
+    if(ma == &shared_arena) {
+        drain_magazines();
     }
-    // Step 2: scan the right tree for open space.  Add an offset if we found
-    //         space, otherwise just return a -1
-    ref = get_mem(size, block->right_child, available>>1);
-    if(ref < 0) {
+
+    data_offset = buddy_snapshot_size(&ma->buddy);
+    if(!buf) {
+        return data_offset + ma->buddy.mem_size;
+    }
+    if(size < data_offset + ma->buddy.mem_size) {
         return -1;
     }
-    ref += (available>>1);
-    return ref;
 
+    // The bookkeeping is copied out under the arena's lock, so take it into a
+    // kernel buffer first.  Handle arenas must not be compacted until the
+    // contents are copied too, or they wouldn't match the bookkeeping
+    state = kvmalloc(data_offset, GFP_KERNEL);
+    if(!state) {
+        return -1;
+    }
+    if(handle_arena(ma)) {
+        down_read(&ma->compact_lock);
+    }
+    if(buddy_snapshot(&ma->buddy, state, data_offset) == data_offset &&
+       !copy_to_user(buf, state, data_offset) &&
+       !copy_to_user(buf + data_offset, ma->memory, ma->buddy.mem_size)) {
+        ret = data_offset + ma->buddy.mem_size;
+    }
+    if(handle_arena(ma)) {
+        up_read(&ma->compact_lock);
+    }
+    kvfree(state);
+
+    return ret;
 }
 
-// Frees memory.  0 on success, -1 on failure
-int free_mem(int ref) {
-    struct block_node *block;
-    block = __get_block_from_address(ref);
+// Gives the file handle a private arena restored from the snapshot in the
+// size bytes at buf.  Only possible before the handle's first allocation.
+// 0 on success, -1 on failure
+int restore_arena(struct file *file, const char *buf, long size) {
+    struct mem_file *mf = file->private_data;
+    struct buddy_snapshot hdr;
+    struct mem_arena *ma;
+    void *state;
+    long data_offset;
+    long footprint;
+
+    if(READ_ONCE(mf->arena) || size < (long)sizeof(hdr) || copy_from_user(&hdr, buf, sizeof(hdr))) {
+        return -1;
+    }
+    data_offset = buddy_snapshot_check(&hdr);
+    if(data_offset < 0 || size - data_offset < hdr.mem_size || hdr.mem_size >= BUDDY_RING_OFFSET) {
+        return -1;
+    }
+    footprint = arena_footprint(hdr.mem_size, hdr.block_size, hdr.handles_used >= 0, hdr.slab_order >= 0);
+    if(footprint < 0 || footprint > max_private_size) {
+        return -1;
+    }
+    // Like __create_arena, no handles or rings past INT_MAX bytes
+    if(hdr.mem_size > INT_MAX && (hdr.handles_used >= 0 || READ_ONCE(mf->ring))) {
+        return -1;
+    }
 
-    if(block == NULL || block->state != ALLOCATED) {
+    state = kvmalloc(data_offset, GFP_KERNEL);
+    if(!state) {
         return -1;
     }
+    ma = kzalloc(sizeof(*ma), GFP_KERNEL);
+    if(!ma || copy_from_user(state, buf, data_offset)) {
+        goto fail_arena;
+    }
+    spin_lock_init(&ma->lock);
+    init_rwsem(&ma->compact_lock);
+    ma->memory = vmalloc_user(PAGE_ALIGN(hdr.mem_size));
+    if(!ma->memory) {
+        goto fail_arena;
+    }
+
+    // The header is read again from user space along with the rest, so
+    // check that it still describes the arena that was allocated for it
+    if(buddy_restore(&ma->buddy, state, data_offset, &buddy_private_hooks, &ma->lock) < 0) {
+        goto fail_memory;
+    }
+    if(ma->buddy.mem_size != hdr.mem_size || copy_from_user(ma->memory, buf + data_offset, hdr.mem_size)) {
+        goto fail_restored;
+    }
+    kvfree(state);
 
-    __free_and_merge(block);
+    // Someone else may have allocated on this handle (or created an arena)
+    // in the meantime, in which case they win
+    if(cmpxchg(&mf->arena, NULL, ma) != NULL) {
+        teardown_arena(ma);
+        kfree(ma);
+        return -1;
+    }
 
     return 0;
+
+fail_restored:
+    buddy_destroy(&ma->buddy);
+fail_memory:
+    vfree(ma->memory);
+fail_arena:
+    kfree(ma);
+    kvfree(state);
+    return -1;
 }
 
-/// ------------------------------------------------------------------------ ///
+/// ------------------- SUBMISSION AND COMPLETION RINGS -------------------- ///
 
+// How long the polling thread keeps spinning on an empty ring before it goes
+// to sleep and sets BUDDY_RING_NEED_WAKEUP
+static int ring_idle_us = 1000;
+module_param(ring_idle_us, int, 0644);
+MODULE_PARM_DESC(ring_idle_us, "Microseconds a ring's polling thread spins before sleeping");
 
-static int open(struct inode *inode, struct file *file) {
-    printk("----open(...)\n");
+// Copies size bytes from block src to block dst, both in the same arena.
+// Data never crosses into user space (the polling thread has no user space
+// to cross into), so clients that want to see it mmap the arena.
+// size on success, -1 on failure
+static long copy_mem(struct mem_arena *ma, long dst, long src, long size) {
+    long ret = -1;
 
-    // TODO: a more sound approach would be to use a read-write semaphore.  This
-    // is just what driver-07.c does, and for now it will do.
-    if(Device_Open) {
-        return -EBUSY;
-    } else {
-        Device_Open++;
+    hold_refs(ma);
+    dst = resolve_ref(ma, dst);
+    src = resolve_ref(ma, src);
+    if(buddy_check_range(&ma->buddy, dst, size) == 0 && buddy_check_range(&ma->buddy, src, size) == 0) {
+        memmove(ma->memory + dst, ma->memory + src, size);
+        ret = size;
     }
+    release_refs(ma);
 
-    return 0;
+    return ret;
 }
 
-static int release(struct inode *inode, struct file *file) {
-    printk("----release(...)\n");
+static int ring_command(struct file *file, struct buddy_sqe *sqe) {
+    // setup_ring and __create_arena keep rings and big arenas apart, but if
+    // they race, the arena can still end up too big for the entries
+    if(file_arena(file)->buddy.mem_size > INT_MAX) {
+        return -1;
+    }
+
+    switch(sqe->opcode) {
+    case BUDDY_OP_GET_MEM:
+        return get_mem(file_arena_commit(file), file->private_data, sqe->size);
+    case BUDDY_OP_FREE_MEM:
+        return free_mem(file_arena(file), file->private_data, sqe->ref);
+    case BUDDY_OP_COPY_MEM:
+        return copy_mem(file_arena(file), sqe->ref, sqe->src, sqe->size);
+    default:
+        return -1;
+    }
+}
+
+// Consumes every submission there is room to complete.  Returns how many were consumed
+static int ring_consume(struct file *file, struct mem_ring *mr) {
+    struct buddy_ring *shared = mr->shared;
+    struct buddy_sqe sqe;
+    struct buddy_cqe *cqe;
+    unsigned int sq_tail;
+    unsigned int cq_head;
+    int n = 0;
+
+    mutex_lock(&mr->lock);
+    sq_tail = smp_load_acquire(&shared->sq_tail);
+    cq_head = smp_load_acquire(&shared->cq_head);
+    while(mr->sq_head != sq_tail && mr->cq_tail - cq_head < BUDDY_RING_ENTRIES) {
+        // Take a private copy, userspace may scribble on the entry meanwhile
+        memcpy(&sqe, &shared->sq[mr->sq_head % BUDDY_RING_ENTRIES], sizeof(sqe));
+        mr->sq_head++;
+
+        cqe = &shared->cq[mr->cq_tail % BUDDY_RING_ENTRIES];
+        cqe->user_data = sqe.user_data;
+        cqe->result = ring_command(file, &sqe);
+        mr->cq_tail++;
+        n++;
+    }
+    if(n > 0) {
+        smp_store_release(&shared->sq_head, mr->sq_head);
+        smp_store_release(&shared->cq_tail, mr->cq_tail);
+    }
+    mutex_unlock(&mr->lock);
+
+    return n;
+}
+
+static bool ring_pending(struct mem_ring *mr) {
+    return mr->sq_head != smp_load_acquire(&mr->shared->sq_tail);
+}
+
+// Polls the ring for as long as the handle is open.  After ring_idle_us
+// without work it advertises BUDDY_RING_NEED_WAKEUP and sleeps until the
+// doorbell wakes it
+static int ring_thread(void *data) {
+    struct file *file = data;
+    struct mem_ring *mr = ((struct mem_file *)file->private_data)->ring;
+    unsigned long idle_at = jiffies + usecs_to_jiffies(ring_idle_us);
+
+    while(!kthread_should_stop()) {
+        if(ring_consume(file, mr) > 0) {
+            idle_at = jiffies + usecs_to_jiffies(ring_idle_us);
+        } else if(time_after(jiffies, idle_at)) {
+            set_current_state(TASK_INTERRUPTIBLE);
+            // Pairs with the client's check of the flag after bumping sq_tail:
+            // either it sees the flag, or we see its submission
+            smp_store_mb(mr->shared->flags, BUDDY_RING_NEED_WAKEUP);
+            if(!ring_pending(mr) && !kthread_should_stop()) {
+                schedule();
+            }
+            __set_current_state(TASK_RUNNING);
+            WRITE_ONCE(mr->shared->flags, 0);
+            idle_at = jiffies + usecs_to_jiffies(ring_idle_us);
+        }
+        cond_resched();
+    }
 
-    Device_Open--;
-    
     return 0;
 }
 
-static ssize_t read(struct file *file, char *buffer, size_t length, loff_t *offset) {
-    copy_to_user(buffer, memory + (long)offset, length);
+// A thread that was created but never woken just exits
+static void teardown_ring(struct mem_ring *mr) {
+    if(mr->thread) {
+        kthread_stop(mr->thread);
+    }
+    vfree(mr->shared);
+    kfree(mr);
+}
 
-    return length;
+// Gives the file handle its rings, with a polling thread if flags says so.
+// Only once per handle.  0 on success, -1 on failure
+int setup_ring(struct file *file, int flags) {
+    struct mem_file *mf = file->private_data;
+    struct mem_ring *mr;
+
+    if(READ_ONCE(mf->ring) || (flags & ~BUDDY_RING_POLL)) {
+        return -1;
+    }
+    // Entries hold ints, which can't name everything in a bigger arena
+    if(file_arena(file)->buddy.mem_size > INT_MAX) {
+        return -1;
+    }
+
+    mr = kzalloc(sizeof(*mr), GFP_KERNEL);
+    if(!mr) {
+        return -1;
+    }
+    mr->shared = vmalloc_user(PAGE_ALIGN(sizeof(struct buddy_ring)));
+    if(!mr->shared) {
+        kfree(mr);
+        return -1;
+    }
+    mutex_init(&mr->lock);
+
+    // The thread is only woken once the ring is installed, since it looks it up
+    if(flags & BUDDY_RING_POLL) {
+        mr->thread = kthread_create(ring_thread, file, "buddy-ring");
+        if(IS_ERR(mr->thread)) {
+            mr->thread = NULL;
+            teardown_ring(mr);
+            return -1;
+        }
+    }
+
+    if(cmpxchg(&mf->ring, NULL, mr) != NULL) {
+        teardown_ring(mr);
+        return -1;
+    }
+    if(mr->thread) {
+        wake_up_process(mr->thread);
+    }
+
+    return 0;
 }
 
-static ssize_t write(struct file *file, const char *buffer, size_t length, loff_t *offset) {
-    copy_from_user(memory + (long)offset, buffer, length);
+// Consumes the ring's submissions, or wakes its polling thread to do it.
+// Number of submissions consumed on success, -1 if the handle has no ring
+int ring_enter(struct file *file) {
+    struct mem_ring *mr = READ_ONCE(((struct mem_file *)file->private_data)->ring);
 
-    return length;
+    if(!mr) {
+        return -1;
+    }
+    if(mr->thread) {
+        wake_up_process(mr->thread);
+        return 0;
+    }
+
+    return ring_consume(file, mr);
 }
 
-/// -------------- Some more buddy allocator wrapper functions ------------- ///
+/// ------------------------------ 64-BIT ABI ------------------------------ ///
 
-// Writes to memory.  Num bytes written on success, -1 on failure
-int write_mem(struct file *file, int ref, char *buf) {
-    struct block_node *block1;
-    struct block_node *block2;
-    int size;
-    long rf;
+// These back the *64_struct ioctls (see BUDDY_ABI_VERSION).  Each one returns 0
+// on success or a -errno, which the ioctl hands back in the struct's error
 
-    size = strlen(buf);
+// get_mem, or get_mem_aligned unless align is 0.  The block's ref goes in *ref
+static int get_mem64(struct mem_arena *ma, struct mem_file *mf, int version,
+                     u64 size, u64 align, unsigned long long *ref) {
+    long got;
 
-    block1 = __get_block_from_address(ref);
-    block2 = __get_block_from_address(ref + size -1);
+    if(version != BUDDY_ABI_VERSION || size > ma->buddy.mem_size || align > ma->buddy.mem_size) {
+        return -EINVAL;
+    }
+    if(align && (!is_power_of_2(align) || handle_arena(ma))) {
+        return -EINVAL;
+    }
 
-    // Sanity check -- if the blocks are NULL or if they aren't the same,
-    // then there is an error
-    rf = ref;
-    if(block1 && block1 == block2) {
-        return (int)write(file, buf, size, (loff_t *)rf);
+    got = align ? get_mem_aligned(ma, mf, size, align) : get_mem(ma, mf, size);
+    if(got < 0) {
+        return -ENOMEM;
     }
+    *ref = got;
 
-    return -1;
+    return 0;
 }
 
-// Reads from memory.  Num bytes read on success, -1 on failure
-int read_mem(struct file *file, int ref, char *buf, int size) {
-    struct block_node *block1;
-    struct block_node *block2;
-    long rf;
+static int free_mem64(struct mem_arena *ma, struct mem_file *mf, int version, u64 ref) {
+    if(version != BUDDY_ABI_VERSION || ref > LONG_MAX) {
+        return -EINVAL;
+    }
+    if(foreign_ref(ma, mf, ref)) {
+        return -EPERM;
+    }
 
-    block1 = __get_block_from_address(ref);
-    block2 = __get_block_from_address(ref + size -1);
+    return free_mem(ma, mf, ref) < 0 ? -EINVAL : 0;
+}
 
-    // Sanity check -- if the blocks are NULL or if they aren't the same,
-    // then there is an error
-    rf = ref;
-    if(block1 && block1 == block2) {
-        return (int)read(file, buf, size, (loff_t *)rf);
+// Moves exactly size bytes between buf and the arena at ref, which have to lie
+// in one block.  Unlike read_mem, a bad buf is reported rather than ignored
+static int rw_mem64(struct file *file, int version, u64 ref, char *buf, u64 size, bool writing) {
+    struct mem_arena *ma = file_arena(file);
+    char *data;
+    long at;
+    int ret = -EINVAL;
+
+    if(version != BUDDY_ABI_VERSION || ref > LONG_MAX || size > ma->buddy.mem_size) {
+        return -EINVAL;
     }
 
-    return -1;
+    hold_refs(ma);
+    at = resolve_ref(ma, ref);
+    if(buddy_check_range(&ma->buddy, at, size) == 0) {
+        data = ma->memory + at;
+        ret = (writing ? copy_from_user(data, buf, size) : copy_to_user(buf, data, size)) ? -EFAULT : 0;
+    }
+    release_refs(ma);
+
+    return ret;
+}
+
+static int create_arena64(struct file *file, int version, u64 size, int bsize, int flags, int placement) {
+    if(version != BUDDY_ABI_VERSION || size > LONG_MAX) {
+        return -EINVAL;
+    }
+
+    return __create_arena(file, size, bsize, flags, placement);
 }
 
 /// ------------------------------------------------------------------------ ///
 
+// The ioctls whose structs hold refs or sizes in ints, which fail with
+// EOVERFLOW on an arena of more than INT_MAX bytes.  The ioctl leaves
+// return_val alone then, so callers see the -1 they filled it with
+static bool int_ioctl(unsigned int ioctl_num) {
+    switch(ioctl_num) {
+    case IOCTL_GET_MEM:
+    case IOCTL_GET_MEM_EXACT:
+    case IOCTL_GET_MEM_ALIGNED:
+    case IOCTL_FREE_MEM:
+    case IOCTL_REALLOC_MEM:
+    case IOCTL_WRITE_MEM:
+    case IOCTL_READ_MEM:
+    case IOCTL_GET_MEM_BATCH:
+    case IOCTL_FREE_MEM_BATCH:
+    case IOCTL_WRITE_MEM_LEN:
+    case IOCTL_WRITEV_MEM:
+    case IOCTL_READV_MEM:
+    case IOCTL_GET_GEOMETRY:
+    case IOCTL_RESOLVE_HANDLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Every ioctl's parameters.  ioctl copies them in from user space before it
+// acts on them and back out once it is done, so the driver never reaches
+// through a pointer it was handed
+union ioctl_params {
+    struct get_mem_struct get_mem;
+    struct get_mem_aligned_struct get_mem_aligned;
+    struct free_mem_struct free_mem;
+    struct realloc_mem_struct realloc_mem;
+    struct write_mem_struct write_mem;
+    struct read_mem_struct read_mem;
+    struct get_mem_batch_struct get_mem_batch;
+    struct free_mem_batch_struct free_mem_batch;
+    struct write_mem_len_struct write_mem_len;
+    struct mem_iovec_struct mem_iovec;
+    struct setup_ring_struct setup_ring;
+    struct ring_enter_struct ring_enter;
+    struct geometry_struct geometry;
+    struct create_arena_struct create_arena;
+    struct resolve_handle_struct resolve_handle;
+    struct reset_arena_struct reset_arena;
+    struct compact_struct compact;
+    struct snapshot_arena_struct snapshot_arena;
+    struct restore_arena_struct restore_arena;
+    struct get_mem64_struct get_mem64;
+    struct free_mem64_struct free_mem64;
+    struct read_mem64_struct read_mem64;
+    struct write_mem64_struct write_mem64;
+    struct geometry64_struct geometry64;
+    struct create_arena64_struct create_arena64;
+};
+
+// How many bytes of union ioctl_params ioctl_num takes, or 0 if it is no ioctl of ours
+static size_t ioctl_params_size(unsigned int ioctl_num) {
+    switch(ioctl_num) {
+    case IOCTL_GET_MEM:
+    case IOCTL_GET_MEM_EXACT:
+        return sizeof(struct get_mem_struct);
+    case IOCTL_GET_MEM_ALIGNED:
+        return sizeof(struct get_mem_aligned_struct);
+    case IOCTL_FREE_MEM:
+        return sizeof(struct free_mem_struct);
+    case IOCTL_REALLOC_MEM:
+        return sizeof(struct realloc_mem_struct);
+    case IOCTL_WRITE_MEM:
+        return sizeof(struct write_mem_struct);
+    case IOCTL_READ_MEM:
+        return sizeof(struct read_mem_struct);
+    case IOCTL_GET_MEM_BATCH:
+        return sizeof(struct get_mem_batch_struct);
+    case IOCTL_FREE_MEM_BATCH:
+        return sizeof(struct free_mem_batch_struct);
+    case IOCTL_WRITE_MEM_LEN:
+        return sizeof(struct write_mem_len_struct);
+    case IOCTL_WRITEV_MEM:
+    case IOCTL_READV_MEM:
+        return sizeof(struct mem_iovec_struct);
+    case IOCTL_SETUP_RING:
+        return sizeof(struct setup_ring_struct);
+    case IOCTL_RING_ENTER:
+        return sizeof(struct ring_enter_struct);
+    case IOCTL_GET_GEOMETRY:
+        return sizeof(struct geometry_struct);
+    case IOCTL_CREATE_ARENA:
+        return sizeof(struct create_arena_struct);
+    case IOCTL_RESOLVE_HANDLE:
+        return sizeof(struct resolve_handle_struct);
+    case IOCTL_RESET_ARENA:
+        return sizeof(struct reset_arena_struct);
+    case IOCTL_COMPACT:
+        return sizeof(struct compact_struct);
+    case IOCTL_SNAPSHOT_ARENA:
+        return sizeof(struct snapshot_arena_struct);
+    case IOCTL_RESTORE_ARENA:
+        return sizeof(struct restore_arena_struct);
+    case IOCTL_GET_MEM64:
+        return sizeof(struct get_mem64_struct);
+    case IOCTL_FREE_MEM64:
+        return sizeof(struct free_mem64_struct);
+    case IOCTL_READ_MEM64:
+        return sizeof(struct read_mem64_struct);
+    case IOCTL_WRITE_MEM64:
+        return sizeof(struct write_mem64_struct);
+    case IOCTL_GET_GEOMETRY64:
+        return sizeof(struct geometry64_struct);
+    case IOCTL_CREATE_ARENA64:
+        return sizeof(struct create_arena64_struct);
+    default:
+        return 0;
+    }
+}
+
 long ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_param) {
+    union ioctl_params params;
+    size_t size = ioctl_params_size(ioctl_num);
+    u64 start = histograms ? ktime_get_ns() : 0;
+    int op = -1;
+
+    if(size == 0) {
+        printk(KERN_ALERT "Invalid IOCTL switch %d!\n", ioctl_num);
+        return -ENOTTY;
+    }
+    if(int_ioctl(ioctl_num) && file_arena(file)->buddy.mem_size > INT_MAX) {
+        return -EOVERFLOW;
+    }
+    if(copy_from_user(&params, (void *)ioctl_param, size)) {
+        return -EFAULT;
+    }
+
     switch(ioctl_num) {
     case IOCTL_GET_MEM:
-        printk("    get_mem(...)\n");
-        ((struct get_mem_struct *)ioctl_param)->return_val = get_mem(
-            ((struct get_mem_struct *)ioctl_param)->size,
-            buddy_root,
-            MEM_SIZE
+        op = LAT_GET_MEM;
+        params.get_mem.return_val = get_mem(
+            file_arena_commit(file),
+            file->private_data,
+            params.get_mem.size
+        );
+        break;
+    case IOCTL_GET_MEM_EXACT:
+        op = LAT_GET_MEM;
+        params.get_mem.return_val = get_mem_exact(
+            file_arena_commit(file),
+            file->private_data,
+            params.get_mem.size
+        );
+        break;
+    case IOCTL_GET_MEM_ALIGNED:
+        op = LAT_GET_MEM;
+        params.get_mem_aligned.return_val = get_mem_aligned(
+            file_arena_commit(file),
+            file->private_data,
+            params.get_mem_aligned.size,
+            params.get_mem_aligned.align
         );
         break;
     case IOCTL_FREE_MEM:
-        printk("    free_mem(...)\n");
-        ((struct free_mem_struct *)ioctl_param)->return_val = free_mem(
-            ((struct free_mem_struct *)ioctl_param)->ref
+        op = LAT_FREE_MEM;
+        params.free_mem.return_val = free_mem(
+            file_arena(file),
+            file->private_data,
+            params.free_mem.ref
+        );
+        break;
+
+    case IOCTL_REALLOC_MEM:
+        op = LAT_REALLOC_MEM;
+        params.realloc_mem.return_val = realloc_mem(
+            file_arena(file),
+            file->private_data,
+            params.realloc_mem.ref,
+            params.realloc_mem.size
         );
         break;
 
     case IOCTL_WRITE_MEM:
-        printk("    write_mem(...)\n");
-        ((struct write_mem_struct *)ioctl_param)->return_val = write_mem(
+        op = LAT_WRITE_MEM;
+        params.write_mem.return_val = write_mem(
             file,
-            ((struct write_mem_struct *)ioctl_param)->ref,
-            ((struct write_mem_struct *)ioctl_param)->buf
+            params.write_mem.ref,
+            params.write_mem.buf
         );
         break;
 
     case IOCTL_READ_MEM:
-        printk("    read_mem(...)\n");
-        ((struct read_mem_struct *)ioctl_param)->return_val = read_mem(
+        op = LAT_READ_MEM;
+        params.read_mem.return_val = read_mem(
             file,
-            ((struct read_mem_struct *)ioctl_param)->ref,
-            ((struct read_mem_struct *)ioctl_param)->buf,
-            ((struct read_mem_struct *)ioctl_param)->size
+            params.read_mem.ref,
+            params.read_mem.buf,
+            params.read_mem.size
         );
         break;
 
-    default:
-        printk(KERN_ALERT "Invalid IOCTL switch %d!\n", ioctl_num);
+    case IOCTL_GET_MEM_BATCH:
+        op = LAT_GET_MEM_BATCH;
+        params.get_mem_batch.return_val = get_mem_batch(
+            file_arena_commit(file),
+            file->private_data,
+            params.get_mem_batch.sizes,
+            params.get_mem_batch.refs,
+            params.get_mem_batch.count
+        );
+        break;
+
+    case IOCTL_FREE_MEM_BATCH:
+        op = LAT_FREE_MEM_BATCH;
+        params.free_mem_batch.return_val = free_mem_batch(
+            file_arena(file),
+            file->private_data,
+            params.free_mem_batch.refs,
+            params.free_mem_batch.results,
+            params.free_mem_batch.count
+        );
+        break;
+
+    case IOCTL_WRITE_MEM_LEN:
+        op = LAT_WRITE_MEM_LEN;
+        params.write_mem_len.return_val = write_mem_len(
+            file,
+            params.write_mem_len.ref,
+            params.write_mem_len.buf,
+            params.write_mem_len.size
+        );
+        break;
+
+    case IOCTL_WRITEV_MEM:
+        op = LAT_WRITEV_MEM;
+        params.mem_iovec.return_val = rw_mem_vec(
+            file,
+            params.mem_iovec.iov,
+            params.mem_iovec.count,
+            true
+        );
+        break;
+
+    case IOCTL_READV_MEM:
+        op = LAT_READV_MEM;
+        params.mem_iovec.return_val = rw_mem_vec(
+            file,
+            params.mem_iovec.iov,
+            params.mem_iovec.count,
+            false
+        );
+        break;
+
+    case IOCTL_SETUP_RING:
+        params.setup_ring.return_val = setup_ring(
+            file,
+            params.setup_ring.flags
+        );
+        break;
+
+    case IOCTL_RING_ENTER:
+        op = LAT_RING_ENTER;
+        params.ring_enter.return_val = ring_enter(file);
+        break;
+
+    case IOCTL_GET_GEOMETRY:
+        params.geometry.mem_size = file_arena(file)->buddy.mem_size;
+        params.geometry.block_size = file_arena(file)->buddy.block_size;
+        params.geometry.depth = file_arena(file)->buddy.depth;
+        params.geometry.return_val = 0;
+        break;
+
+    case IOCTL_CREATE_ARENA:
+        params.create_arena.return_val = create_arena(
+            file,
+            params.create_arena.mem_size,
+            params.create_arena.block_size,
+            params.create_arena.flags,
+            params.create_arena.policy
+        );
+        break;
+
+    case IOCTL_RESOLVE_HANDLE:
+        params.resolve_handle.return_val = resolve_handle(
+            file_arena(file),
+            params.resolve_handle.handle
+        );
+        break;
+
+    case IOCTL_RESET_ARENA:
+        op = LAT_RESET_ARENA;
+        params.reset_arena.return_val = reset_arena(file_arena(file));
+        break;
+
+    case IOCTL_COMPACT:
+        op = LAT_COMPACT;
+        params.compact.return_val = compact_arena(
+            file_arena(file),
+            params.compact.max_moves
+        );
+        break;
+
+    case IOCTL_SNAPSHOT_ARENA:
+        params.snapshot_arena.return_val = snapshot_arena(
+            file_arena(file),
+            params.snapshot_arena.buf,
+            params.snapshot_arena.size
+        );
+        break;
+
+    case IOCTL_RESTORE_ARENA:
+        params.restore_arena.return_val = restore_arena(
+            file,
+            params.restore_arena.buf,
+            params.restore_arena.size
+        );
+        break;
+
+    case IOCTL_GET_MEM64:
+        op = LAT_GET_MEM;
+        params.get_mem64.error = -get_mem64(
+            file_arena_commit(file),
+            file->private_data,
+            params.get_mem64.version,
+            params.get_mem64.size,
+            params.get_mem64.align,
+            &params.get_mem64.ref
+        );
+        break;
+
+    case IOCTL_FREE_MEM64:
+        op = LAT_FREE_MEM;
+        params.free_mem64.error = -free_mem64(
+            file_arena(file),
+            file->private_data,
+            params.free_mem64.version,
+            params.free_mem64.ref
+        );
+        break;
+
+    case IOCTL_READ_MEM64:
+        op = LAT_READ_MEM;
+        params.read_mem64.error = -rw_mem64(
+            file,
+            params.read_mem64.version,
+            params.read_mem64.ref,
+            params.read_mem64.buf,
+            params.read_mem64.size,
+            false
+        );
+        break;
+
+    case IOCTL_WRITE_MEM64:
+        op = LAT_WRITE_MEM_LEN;
+        params.write_mem64.error = -rw_mem64(
+            file,
+            params.write_mem64.version,
+            params.write_mem64.ref,
+            params.write_mem64.buf,
+            params.write_mem64.size,
+            true
+        );
+        break;
+
+    case IOCTL_GET_GEOMETRY64:
+        if(params.geometry64.version != BUDDY_ABI_VERSION) {
+            params.geometry64.error = EINVAL;
+            break;
+        }
+        params.geometry64.mem_size = file_arena(file)->buddy.mem_size;
+        params.geometry64.block_size = file_arena(file)->buddy.block_size;
+        params.geometry64.depth = file_arena(file)->buddy.depth;
+        params.geometry64.error = 0;
+        break;
+
+    case IOCTL_CREATE_ARENA64:
+        params.create_arena64.error = -create_arena64(
+            file,
+            params.create_arena64.version,
+            params.create_arena64.mem_size,
+            params.create_arena64.block_size,
+            params.create_arena64.flags,
+            params.create_arena64.policy
+        );
         break;
+
     }
 
-    return 0;
+    if(histograms && op >= 0) {
+        record_latency(op, ktime_get_ns() - start);
+    }
+
+    return copy_to_user((void *)ioctl_param, &params, size) ? -EFAULT : 0;
 }
 
 
 struct file_operations Fops = {
    .read = read,
    .write = write,
+   .mmap = mmap,
    .unlocked_ioctl = ioctl,
    .open = open,
    .release = release
@@ -307,33 +2343,70 @@ struct file_operations Fops = {
 
 int init_module(void) {
     int ret_val;
+    int cpu;
 
     printk("Buddy Allocator loading...\n");
 
-    ret_val = register_chrdev(MAJOR_NUM, DEVICE_NAME, &Fops);
+    ret_val = setup_arena(&shared_arena, mem_size, block_size, BUDDY_POLICY_DEFAULT, &buddy_shared_hooks);
     if(ret_val < 0) {
-        printk(KERN_ALERT "***Could not load buddy allocator***\n");
+        printk(KERN_ALERT "***Could not set up the arena (mem_size and block_size must be powers of two, policy 1 to 3)***\n");
         return ret_val;
     }
 
-    // GFP flag so that we can sleep while not in use but also greedily grab memory
-    memory = kmalloc(MEM_SIZE, GFP_KERNEL);
-    memset(memory, 0, MEM_SIZE);
+    magazine_tags = kvzalloc(mem_size / block_size, GFP_KERNEL);
+    owner_shift = ilog2(block_size);
+    block_owners = kvcalloc(mem_size >> owner_shift, sizeof(u32), GFP_KERNEL);
+    if(!magazine_tags || !block_owners) {
+        printk(KERN_ALERT "***Could not allocate the magazine and owner tags***\n");
+        ret_val = -ENOMEM;
+        goto fail_tags;
+    }
+    if(record && setup_record_rings() < 0) {
+        printk(KERN_ALERT "***Could not allocate the record rings***\n");
+        ret_val = -ENOMEM;
+        goto fail_record;
+    }
+    for_each_possible_cpu(cpu) {
+        spin_lock_init(&per_cpu_ptr(&cpu_caches, cpu)->lock);
+    }
+
+    // Statistics are nice to have, so a missing debugfs is not an error
+    debug_dir = debugfs_create_dir("buddy", NULL);
+    debugfs_create_file("stats", 0444, debug_dir, NULL, &stats_fops);
+    debugfs_create_file("latency", 0444, debug_dir, NULL, &latency_fops);
+    if(record) {
+        debugfs_create_file("trace", 0400, debug_dir, NULL, &trace_fops);
+    }
 
-    buddy_root = kmalloc(sizeof(struct block_node), GFP_KERNEL);
-    buddy_root->state = FREE;
-    buddy_root->parent = NULL;
-    buddy_root->left_child = NULL;
-    buddy_root->right_child = NULL;
+    // Only register once everything is set up, so no ioctl can see a half-built arena
+    ret_val = register_chrdev(MAJOR_NUM, DEVICE_NAME, &Fops);
+    if(ret_val < 0) {
+        printk(KERN_ALERT "***Could not load buddy allocator***\n");
+        goto fail_chrdev;
+    }
 
-    printk("Success! Major number = %d\n", MAJOR_NUM);
+    printk("Success! Major number = %d, %ld bytes in blocks of %d\n", MAJOR_NUM, mem_size, block_size);
 
     return 0;
+
+fail_chrdev:
+    debugfs_remove_recursive(debug_dir);
+fail_record:
+    teardown_record_rings();
+fail_tags:
+    kvfree(magazine_tags);
+    kvfree(block_owners);
+    teardown_arena(&shared_arena);
+    return ret_val;
 }
 
 void cleanup_module(void) {
     printk("Buddy Allocator cleaning up...\n");
     unregister_chrdev(MAJOR_NUM, DEVICE_NAME);
-    kfree(memory);
-    free_tree(buddy_root);
-}
\ No newline at end of file
+    debugfs_remove_recursive(debug_dir);
+    teardown_record_rings();
+    teardown_arena(&shared_arena);
+    kvfree(magazine_tags);
+    kvfree(block_owners);
+    xa_destroy(&object_owners);
+}
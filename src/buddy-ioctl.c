@@ -7,12 +7,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buddy-dev.h"
 
+// A client's side of the rings set up by ring_setup
+struct ring_client {
+    int mem;
+    struct buddy_ring *ring;
+    int poll;
+};
 
 // Request a block of memory of size size bytes from the memory manager whose handle is mem.
 // Returns an integer which is a reference to the block (or a negative number on failure).
@@ -20,7 +29,8 @@ int get_mem(int mem, int size) {
 
     struct get_mem_struct params = {
         .mem = mem,
-        .size = size
+        .size = size,
+        .return_val = -1
     };
 
     ioctl(mem, IOCTL_GET_MEM, (void *)(&params));
@@ -28,13 +38,64 @@ int get_mem(int mem, int size) {
     return params.return_val;
 }
 
+// Like get_mem, but the reference is a multiple of align, which has to be a power of two.
+// With the arena mmap'd, that places the block on e.g. a cache line or page boundary.
+// The block is not rounded up to align.  Returns a negative number on failure.
+int get_mem_aligned(int mem, int size, int align) {
+
+    struct get_mem_aligned_struct params = {
+        .mem = mem,
+        .size = size,
+        .align = align,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_GET_MEM_ALIGNED, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Like get_mem, but only takes as many minimum blocks as size needs, instead of
+// rounding up to a power of two.  Free it with free_mem as usual.
+// Returns a reference to the block (or a negative number on failure).
+int get_mem_exact(int mem, int size) {
+
+    struct get_mem_struct params = {
+        .mem = mem,
+        .size = size,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_GET_MEM_EXACT, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Resize the block of memory referenced as ref to size bytes, keeping its contents.
+// Returns the block's new reference (often the same one), or a negative number
+// on failure, in which case the old block is still there
+int realloc_mem(int mem, int ref, int size) {
+
+    struct realloc_mem_struct params = {
+        .mem = mem,
+        .ref = ref,
+        .size = size,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_REALLOC_MEM, (void *)(&params));
+
+    return params.return_val;
+}
+
 // Free the block of memory referenced as ref from the memory manager whose handle is mem.
 // Returns 0 on success and -1 on error
 int free_mem(int mem, int ref) {
 
     struct free_mem_struct params = {
         .mem = mem,
-        .ref = ref
+        .ref = ref,
+        .return_val = -1
     };
 
     ioctl(mem, IOCTL_FREE_MEM, (void *)(&params));
@@ -50,7 +111,8 @@ int write_mem(int mem, int ref, char *buf) {
     struct write_mem_struct params = {
         .mem = mem,
         .ref = ref,
-        .buf = buf
+        .buf = buf,
+        .return_val = -1
     };
 
     ioctl(mem, IOCTL_WRITE_MEM, (void *)(&params));
@@ -66,10 +128,540 @@ int read_mem(int mem, int ref, char *buf, int size) {
         .mem = mem,
         .ref = ref,
         .buf = buf,
-        .size = size
+        .size = size,
+        .return_val = -1
     };
 
     ioctl(mem, IOCTL_READ_MEM, (void *)(&params));
 
     return params.return_val;
-}
\ No newline at end of file
+}
+
+// Writes exactly size bytes of buf to the memory block ref of the memory manager whose handle is mem.
+// Unlike write_mem, zeros in buf are written like any other byte.
+// Returns the number of bytes written or a negative number on error.
+int write_mem_len(int mem, int ref, char *buf, int size) {
+
+    struct write_mem_len_struct params = {
+        .mem = mem,
+        .ref = ref,
+        .buf = buf,
+        .size = size,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_WRITE_MEM_LEN, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Writes the count segments of iov to the memory manager whose handle is mem in one call.
+// Returns the total number of bytes written or a negative number on error.
+int writev_mem(int mem, struct mem_iovec *iov, int count) {
+
+    struct mem_iovec_struct params = {
+        .mem = mem,
+        .iov = iov,
+        .count = count,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_WRITEV_MEM, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Reads the count segments of iov from the memory manager whose handle is mem in one call.
+// Returns the total number of bytes read or a negative number on error.
+int readv_mem(int mem, struct mem_iovec *iov, int count) {
+
+    struct mem_iovec_struct params = {
+        .mem = mem,
+        .iov = iov,
+        .count = count,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_READV_MEM, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Requests count blocks at once, of sizes[0..count), from the memory manager whose handle is mem.
+// refs[i] gets the reference for sizes[i] (or a negative number if that one failed).
+// Returns the number of successful allocations or a negative number on error.
+int get_mem_batch(int mem, int *sizes, int *refs, int count) {
+
+    struct get_mem_batch_struct params = {
+        .mem = mem,
+        .count = count,
+        .sizes = sizes,
+        .refs = refs,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_GET_MEM_BATCH, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Frees the count blocks refs[0..count) from the memory manager whose handle is mem.
+// If results is not NULL, results[i] gets 0 or -1 for refs[i].
+// Returns the number of blocks freed or a negative number on error.
+int free_mem_batch(int mem, int *refs, int *results, int count) {
+
+    struct free_mem_batch_struct params = {
+        .mem = mem,
+        .count = count,
+        .refs = refs,
+        .results = results,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_FREE_MEM_BATCH, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Fills in geometry with the arena size, block size and depth the memory manager whose
+// handle is mem is running with.  Returns 0 on success and -1 on error
+int get_geometry(int mem, struct geometry_struct *geometry) {
+
+    geometry->mem = mem;
+    geometry->return_val = -1;
+
+    ioctl(mem, IOCTL_GET_GEOMETRY, (void *)geometry);
+
+    return geometry->return_val;
+}
+
+// Gives the handle mem an arena of its own of mem_size bytes, in blocks of block_size bytes.
+// Must be called before the first get_mem on mem.  The arena is freed when mem is closed.
+// Returns 0 on success and -1 on error
+int create_arena(int mem, int mem_size, int block_size) {
+
+    struct create_arena_struct params = {
+        .mem = mem,
+        .mem_size = mem_size,
+        .block_size = block_size,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_CREATE_ARENA, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Like create_arena, but the arena places blocks by policy, one of the
+// BUDDY_POLICY_* values.  Returns 0 on success and -1 on error
+int create_arena_policy(int mem, int mem_size, int block_size, int policy) {
+
+    struct create_arena_struct params = {
+        .mem = mem,
+        .mem_size = mem_size,
+        .block_size = block_size,
+        .policy = policy,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_CREATE_ARENA, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Like create_arena, but the arena is a handle arena: get_mem returns handles,
+// which stay valid while compact moves their blocks around.  Every other call
+// that takes a ref takes a handle instead.  Returns 0 on success and -1 on error
+int create_handle_arena(int mem, int mem_size, int block_size) {
+
+    struct create_arena_struct params = {
+        .mem = mem,
+        .mem_size = mem_size,
+        .block_size = block_size,
+        .flags = BUDDY_ARENA_HANDLES,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_CREATE_ARENA, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Gives the offset of the block behind handle in the mapping from map_mem.
+// Only good until the next compact.  Returns a negative number on failure
+int resolve_handle(int mem, int handle) {
+
+    struct resolve_handle_struct params = {
+        .mem = mem,
+        .handle = handle,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_RESOLVE_HANDLE, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Moves up to max_moves blocks of a handle arena (all it can if max_moves <= 0)
+// toward its start, so that its free space runs together.
+// Returns the number of blocks moved, or -1 on error
+int compact(int mem, int max_moves) {
+
+    struct compact_struct params = {
+        .mem = mem,
+        .max_moves = max_moves,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_COMPACT, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Frees everything in the private arena of the handle mem in one go, e.g. the
+// scratch memory of a request that has been served.  Every ref and handle
+// from it becomes invalid.  Returns 0 on success and -1 on error
+int reset_arena(int mem) {
+
+    struct reset_arena_struct params = {
+        .mem = mem,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_RESET_ARENA, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Copies a snapshot of the arena of the handle mem into buf, which holds size
+// bytes.  With a NULL buf, only says how big the snapshot would be.  Returns
+// the size of the snapshot, or -1 on error
+long snapshot_arena(int mem, char *buf, long size) {
+
+    struct snapshot_arena_struct params = {
+        .mem = mem,
+        .buf = buf,
+        .size = size,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_SNAPSHOT_ARENA, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Gives the handle mem (before it has allocated anything) a private arena that
+// is a copy of the snapshot in the size bytes at buf.  Returns 0 on success
+// and -1 on error
+int restore_arena(int mem, const char *buf, long size) {
+
+    struct restore_arena_struct params = {
+        .mem = mem,
+        .buf = buf,
+        .size = size,
+        .return_val = -1
+    };
+
+    ioctl(mem, IOCTL_RESTORE_ARENA, (void *)(&params));
+
+    return params.return_val;
+}
+
+// Writes a snapshot of the arena of the handle mem to the file at path.
+// Returns 0 on success and -1 on error
+int save_snapshot(int mem, const char *path) {
+    char *buf;
+    long size;
+    long done;
+    ssize_t n;
+    int fd;
+
+    size = snapshot_arena(mem, NULL, 0);
+    if(size < 0) {
+        return -1;
+    }
+    buf = malloc(size);
+    if(!buf || snapshot_arena(mem, buf, size) != size) {
+        free(buf);
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        free(buf);
+        return -1;
+    }
+    for(done = 0; done < size; done += n) {
+        n = write(fd, buf + done, size - done);
+        if(n <= 0) {
+            break;
+        }
+    }
+    free(buf);
+
+    return close(fd) == 0 && done == size ? 0 : -1;
+}
+
+// Gives the handle mem (before it has allocated anything) a private arena
+// restored from the snapshot file at path, which is mapped rather than read.
+// Returns 0 on success and -1 on error
+int load_snapshot(int mem, const char *path) {
+    struct stat st;
+    void *snap;
+    int ret;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    snap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(snap == MAP_FAILED) {
+        return -1;
+    }
+
+    ret = restore_arena(mem, snap, st.st_size);
+    munmap(snap, st.st_size);
+
+    return ret;
+}
+
+// The 64-bit ABI.  These work on arenas of any size, where the calls above
+// only work on arenas of up to INT_MAX bytes.  Each returns 0 on success, or
+// the errno the memory manager reported (see BUDDY_ABI_VERSION in buddy-dev.h).
+// A driver too old to know the call leaves error as it was, hence ENOTTY
+
+// Request a block of memory of size bytes at a multiple of align (a power of two, or 0 for
+// no particular alignment) from the memory manager whose handle is mem.  *ref gets its reference
+int get_mem64(int mem, unsigned long long size, unsigned long long align, unsigned long long *ref) {
+
+    struct get_mem64_struct params = {
+        .mem = mem,
+        .version = BUDDY_ABI_VERSION,
+        .size = size,
+        .align = align,
+        .error = ENOTTY
+    };
+
+    if(ioctl(mem, IOCTL_GET_MEM64, (void *)(&params)) < 0) {
+        return errno;
+    }
+    if(params.error == 0) {
+        *ref = params.ref;
+    }
+
+    return params.error;
+}
+
+// Free the block of memory referenced as ref from the memory manager whose handle is mem
+int free_mem64(int mem, unsigned long long ref) {
+
+    struct free_mem64_struct params = {
+        .mem = mem,
+        .version = BUDDY_ABI_VERSION,
+        .ref = ref,
+        .error = ENOTTY
+    };
+
+    if(ioctl(mem, IOCTL_FREE_MEM64, (void *)(&params)) < 0) {
+        return errno;
+    }
+
+    return params.error;
+}
+
+// Reads exactly size bytes at ref, which have to lie in one block, into buf
+int read_mem64(int mem, unsigned long long ref, char *buf, unsigned long long size) {
+
+    struct read_mem64_struct params = {
+        .mem = mem,
+        .version = BUDDY_ABI_VERSION,
+        .ref = ref,
+        .buf = buf,
+        .size = size,
+        .error = ENOTTY
+    };
+
+    if(ioctl(mem, IOCTL_READ_MEM64, (void *)(&params)) < 0) {
+        return errno;
+    }
+
+    return params.error;
+}
+
+// Writes exactly size bytes of buf at ref, which have to lie in one block, zeros included
+int write_mem64(int mem, unsigned long long ref, char *buf, unsigned long long size) {
+
+    struct write_mem64_struct params = {
+        .mem = mem,
+        .version = BUDDY_ABI_VERSION,
+        .ref = ref,
+        .buf = buf,
+        .size = size,
+        .error = ENOTTY
+    };
+
+    if(ioctl(mem, IOCTL_WRITE_MEM64, (void *)(&params)) < 0) {
+        return errno;
+    }
+
+    return params.error;
+}
+
+// Like get_geometry, for arenas of any size
+int get_geometry64(int mem, struct geometry64_struct *geometry) {
+
+    geometry->mem = mem;
+    geometry->version = BUDDY_ABI_VERSION;
+    geometry->error = ENOTTY;
+
+    if(ioctl(mem, IOCTL_GET_GEOMETRY64, (void *)geometry) < 0) {
+        return errno;
+    }
+
+    return geometry->error;
+}
+
+// Like create_arena_policy, for arenas of any size.  flags is 0 or BUDDY_ARENA_HANDLES
+int create_arena64(int mem, unsigned long long mem_size, int block_size, int flags, int policy) {
+
+    struct create_arena64_struct params = {
+        .mem = mem,
+        .version = BUDDY_ABI_VERSION,
+        .mem_size = mem_size,
+        .block_size = block_size,
+        .flags = flags,
+        .policy = policy,
+        .error = ENOTTY
+    };
+
+    if(ioctl(mem, IOCTL_CREATE_ARENA64, (void *)(&params)) < 0) {
+        return errno;
+    }
+
+    return params.error;
+}
+
+// Maps the whole arena of the memory manager whose handle is mem into our address space.
+// mem must have been opened for reading and writing.  A ref from get_mem is an offset
+// into the returned mapping.  Returns NULL on error.
+char *map_mem(int mem) {
+    struct geometry64_struct geometry;
+    void *addr;
+
+    if(get_geometry64(mem, &geometry) != 0) {
+        return NULL;
+    }
+
+    addr = mmap(NULL, geometry.mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+    if(addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    return (char *)addr;
+}
+
+// Undoes map_mem on the memory manager whose handle is mem.  Returns 0 on success and -1 on error
+int unmap_mem(int mem, char *view) {
+    struct geometry64_struct geometry;
+
+    if(get_geometry64(mem, &geometry) != 0) {
+        return -1;
+    }
+
+    return munmap(view, geometry.mem_size);
+}
+
+// Gives the memory manager whose handle is mem a pair of submission/completion
+// rings and maps them into rc.  flags is 0 or BUDDY_RING_POLL.
+// Returns 0 on success and -1 on error
+int ring_setup(int mem, struct ring_client *rc, int flags) {
+    void *addr;
+
+    struct setup_ring_struct params = {
+        .mem = mem,
+        .flags = flags,
+        .return_val = -1
+    };
+
+    if(ioctl(mem, IOCTL_SETUP_RING, (void *)(&params)) < 0 || params.return_val < 0) {
+        return -1;
+    }
+
+    addr = mmap(NULL, sizeof(struct buddy_ring), PROT_READ | PROT_WRITE, MAP_SHARED, mem, BUDDY_RING_OFFSET);
+    if(addr == MAP_FAILED) {
+        return -1;
+    }
+    rc->mem = mem;
+    rc->ring = addr;
+    rc->poll = flags & BUDDY_RING_POLL;
+
+    return 0;
+}
+
+// Unmaps the rings.  They stay with the handle until it is closed.
+// Returns 0 on success and -1 on error
+int ring_teardown(struct ring_client *rc) {
+    return munmap(rc->ring, sizeof(struct buddy_ring));
+}
+
+// Queues a command for the driver.  Nothing happens until ring_enter (or the
+// polling thread) gets to it.  Returns 0 on success and -1 if the ring is full
+int ring_submit(struct ring_client *rc, const struct buddy_sqe *sqe) {
+    struct buddy_ring *ring = rc->ring;
+    unsigned int tail = ring->sq_tail;
+
+    if(tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE) == BUDDY_RING_ENTRIES) {
+        return -1;
+    }
+    ring->sq[tail % BUDDY_RING_ENTRIES] = *sqe;
+    __atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Lets the driver know there are submissions.  With a polling thread that is
+// awake this costs no syscall at all.  Returns the number of submissions
+// consumed (always 0 with a polling thread) or a negative number on error
+int ring_enter(struct ring_client *rc) {
+
+    struct ring_enter_struct params = {
+        .mem = rc->mem,
+        .return_val = -1
+    };
+
+    if(rc->poll) {
+        // Pairs with the barrier the thread puts between setting the flag and
+        // looking for submissions
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(!(__atomic_load_n(&rc->ring->flags, __ATOMIC_RELAXED) & BUDDY_RING_NEED_WAKEUP)) {
+            return 0;
+        }
+    }
+
+    if(ioctl(rc->mem, IOCTL_RING_ENTER, (void *)(&params)) < 0) {
+        return -1;
+    }
+
+    return params.return_val;
+}
+
+// Takes the oldest completion off the ring and copies it into cqe.
+// Returns 1 if there was one and 0 if there wasn't
+int ring_reap(struct ring_client *rc, struct buddy_cqe *cqe) {
+    struct buddy_ring *ring = rc->ring;
+    unsigned int head = ring->cq_head;
+
+    if(head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *cqe = ring->cq[head % BUDDY_RING_ENTRIES];
+    __atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
@@ -0,0 +1,389 @@
+/* Author: Garrett Scholtes
+ * Date:   2015-11-18
+ *
+ * buddy-latency.c - Latency benchmarks of the allocator under synthetic workloads.
+ * Every workload runs against a userspace build of the core (buddy-core.c
+ * linked in, behind a mutex) and then, if the module is loaded, against the
+ * device, in a private arena of the same geometry.  Each get and free is
+ * timed on its own and reported as throughput and p50/p99/p99.9 latency.
+ *
+ * Usage: ./buddy-latency [-c] [-m]
+ *     -c    only run against the core, even if /dev/mem_dev is there
+ *     -m    print CSV, one line per backend, workload and operation, for
+ *           regression tracking instead of a table
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "buddy-core.h"
+#include "buddy-ioctl.c"
+
+// 4 MB, which fits in the driver's default max_private_size
+#define ARENA_DEPTH 18
+#define ARENA_BLOCK_SIZE 16
+#define ARENA_SIZE (ARENA_BLOCK_SIZE << ARENA_DEPTH)
+
+// Blocks live at once, and how many times they are all got and freed
+#define WINDOW 1024
+#define ROUNDS 256
+#define WORKLOAD_OPS (WINDOW * ROUNDS)
+
+// Producer/consumer thread pairs, and the queue between each pair
+#define PAIRS 2
+#define QUEUE_SIZE 1024 // A power of two
+
+static bool csv = false;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// ------------------------------- BACKENDS ------------------------------- ///
+
+// Where blocks come from.  Both get a fresh arena for every workload, and are
+// called from several threads at once in the producer/consumer one
+struct backend {
+    const char *name;
+    int (*open)(struct backend *b);
+    void (*close)(struct backend *b);
+    int (*get)(struct backend *b, int size);
+    int (*free)(struct backend *b, int ref);
+
+    struct buddy_arena arena;
+    pthread_mutex_t lock;
+    int mem;
+};
+
+static void *core_alloc(size_t size) {
+    return malloc(size);
+}
+
+static void core_lock(void *lock) {
+    pthread_mutex_lock(lock);
+}
+
+static void core_unlock(void *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+static const struct buddy_hooks core_hooks = {
+    .alloc = core_alloc,
+    .free = free,
+    .lock = core_lock,
+    .unlock = core_unlock
+};
+
+static int core_open(struct backend *b) {
+    pthread_mutex_init(&b->lock, NULL);
+    return buddy_init(&b->arena, ARENA_DEPTH, ARENA_BLOCK_SIZE, &core_hooks, &b->lock);
+}
+
+static void core_close(struct backend *b) {
+    buddy_destroy(&b->arena);
+    pthread_mutex_destroy(&b->lock);
+}
+
+static int core_get(struct backend *b, int size) {
+    return buddy_get_mem(&b->arena, size);
+}
+
+static int core_free(struct backend *b, int ref) {
+    return buddy_free_mem(&b->arena, ref);
+}
+
+// Every thread goes through the same file handle, which owns every block
+static int device_open(struct backend *b) {
+    b->mem = open("/dev/mem_dev", O_RDWR);
+    if(b->mem >= 0 && create_arena(b->mem, ARENA_SIZE, ARENA_BLOCK_SIZE) < 0) {
+        close(b->mem);
+        b->mem = -1;
+    }
+
+    return b->mem < 0 ? -1 : 0;
+}
+
+static void device_close(struct backend *b) {
+    close(b->mem);
+}
+
+static int device_get(struct backend *b, int size) {
+    return get_mem(b->mem, size);
+}
+
+static int device_free(struct backend *b, int ref) {
+    return free_mem(b->mem, ref);
+}
+
+static struct backend core_backend = {"core", core_open, core_close, core_get, core_free};
+static struct backend device_backend = {"device", device_open, device_close, device_get, device_free};
+
+/// ------------------------------- WORKLOADS ------------------------------ ///
+
+enum size_dist {UNIFORM, POWER_LAW};
+enum free_order {LIFO, FIFO, RANDOM};
+
+static const char *const dist_names[] = {"uniform", "powerlaw"};
+static const char *const order_names[] = {"lifo", "fifo", "random"};
+
+// Latencies of one kind of operation, and how many of them failed
+struct samples {
+    double *lat;
+    long n;
+    long failed;
+};
+
+static int next_size(enum size_dist dist, unsigned int *seed) {
+    int k;
+
+    if(dist == UNIFORM) {
+        return 1 + rand_r(seed) % 256;
+    }
+    // Each doubling of the size is half as likely as the last, so that
+    // P(size > x) falls off like 1/x, up to just under 64 KB
+    for(k = 0; k < 11 && rand_r(seed) % 2; k++);
+    return (ARENA_BLOCK_SIZE << k) + rand_r(seed) % (ARENA_BLOCK_SIZE << k);
+}
+
+static int timed_get(struct backend *b, int size, struct samples *s) {
+    double t = now_ns();
+    int ref = b->get(b, size);
+
+    s->lat[s->n++] = now_ns() - t;
+    if(ref < 0) s->failed++;
+    return ref;
+}
+
+static void timed_free(struct backend *b, int ref, struct samples *s) {
+    double t = now_ns();
+    int ret = b->free(b, ref);
+
+    s->lat[s->n++] = now_ns() - t;
+    if(ret < 0) s->failed++;
+}
+
+// Fills a window of WINDOW blocks and empties it in the given order, ROUNDS times
+static void run_window(struct backend *b, enum size_dist dist, enum free_order order,
+                       struct samples *gets, struct samples *frees) {
+    int refs[WINDOW];
+    int idx[WINDOW];
+    unsigned int seed = 1;
+    int r, i, j, tmp;
+
+    for(r = 0; r < ROUNDS; r++) {
+        for(i = 0; i < WINDOW; i++) {
+            refs[i] = timed_get(b, next_size(dist, &seed), gets);
+            idx[i] = order == LIFO ? WINDOW - 1 - i : i;
+        }
+        if(order == RANDOM) {
+            for(i = WINDOW - 1; i > 0; i--) {
+                j = rand_r(&seed) % (i + 1);
+                tmp = idx[i];
+                idx[i] = idx[j];
+                idx[j] = tmp;
+            }
+        }
+        for(i = 0; i < WINDOW; i++) {
+            if(refs[idx[i]] >= 0) timed_free(b, refs[idx[i]], frees);
+        }
+    }
+}
+
+// One producer hands each block it gets to its consumer, which frees it
+struct pc_queue {
+    int refs[QUEUE_SIZE];
+    unsigned int head; // Written by the consumer
+    unsigned int tail; // Written by the producer
+    int done;
+};
+
+struct pc_arg {
+    struct backend *b;
+    struct pc_queue *q;
+    struct samples s;
+    unsigned int seed;
+};
+
+static void *producer(void *p) {
+    struct pc_arg *arg = p;
+    struct pc_queue *q = arg->q;
+    int i, ref;
+
+    for(i = 0; i < WORKLOAD_OPS / PAIRS; i++) {
+        ref = timed_get(arg->b, next_size(UNIFORM, &arg->seed), &arg->s);
+        if(ref < 0) continue;
+        while(q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+            sched_yield();
+        }
+        q->refs[q->tail % QUEUE_SIZE] = ref;
+        __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&q->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void *consumer(void *p) {
+    struct pc_arg *arg = p;
+    struct pc_queue *q = arg->q;
+
+    for(;;) {
+        if(__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head) {
+            if(__atomic_load_n(&q->done, __ATOMIC_ACQUIRE) && __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        timed_free(arg->b, q->refs[q->head % QUEUE_SIZE], &arg->s);
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+// PAIRS producers and PAIRS consumers at once, every block freed by another
+// thread than the one that got it
+static void run_producer_consumer(struct backend *b, struct samples *gets, struct samples *frees) {
+    pthread_t threads[2 * PAIRS];
+    struct pc_queue queues[PAIRS];
+    struct pc_arg args[2 * PAIRS];
+    int i;
+
+    memset(queues, 0, sizeof(queues));
+    for(i = 0; i < 2 * PAIRS; i++) {
+        args[i].b = b;
+        args[i].q = &queues[i / 2];
+        args[i].s.lat = malloc(WORKLOAD_OPS / PAIRS * sizeof(double));
+        args[i].s.n = 0;
+        args[i].s.failed = 0;
+        args[i].seed = i + 1;
+        pthread_create(&threads[i], NULL, i % 2 ? consumer : producer, &args[i]);
+    }
+    for(i = 0; i < 2 * PAIRS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for(i = 0; i < 2 * PAIRS; i++) {
+        struct samples *s = i % 2 ? frees : gets;
+
+        memcpy(s->lat + s->n, args[i].s.lat, args[i].s.n * sizeof(double));
+        s->n += args[i].s.n;
+        s->failed += args[i].s.failed;
+        free(args[i].s.lat);
+    }
+}
+
+/// ------------------------------- REPORTING ------------------------------ ///
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *backend, const char *workload, const char *op, struct samples *s, double wall_ns) {
+    double p50 = 0, p99 = 0, p999 = 0, max = 0;
+
+    if(s->n) {
+        qsort(s->lat, s->n, sizeof(double), compare_doubles);
+        p50 = s->lat[s->n / 2];
+        p99 = s->lat[s->n * 99 / 100];
+        p999 = s->lat[s->n * 999 / 1000];
+        max = s->lat[s->n - 1];
+    }
+
+    if(csv) {
+        printf("%s,%s,%s,%ld,%ld,%.0f,%.0f,%.0f,%.0f,%.0f\n", backend, workload, op, s->n, s->failed,
+            s->n * 1e9 / wall_ns, p50, p99, p999, max);
+    } else {
+        printf("%-7s %-18s %-5s %8ld %8ld %12.0f %9.0f %9.0f %9.0f %9.0f\n", backend, workload, op, s->n,
+            s->failed, s->n * 1e9 / wall_ns, p50, p99, p999, max);
+    }
+}
+
+// Runs one workload on a fresh arena of b: a window one if pc is false,
+// otherwise producer/consumer
+static void run_workload(struct backend *b, enum size_dist dist, enum free_order order, bool pc) {
+    struct samples gets = {malloc(WORKLOAD_OPS * sizeof(double)), 0, 0};
+    struct samples frees = {malloc(WORKLOAD_OPS * sizeof(double)), 0, 0};
+    char workload[32];
+    double wall;
+
+    if(b->open(b) < 0) {
+        fprintf(stderr, "Could not set up a %d byte arena on the %s\n", ARENA_SIZE, b->name);
+        exit(1);
+    }
+    wall = now_ns();
+    if(pc) {
+        run_producer_consumer(b, &gets, &frees);
+        snprintf(workload, sizeof(workload), "producer-consumer");
+    } else {
+        run_window(b, dist, order, &gets, &frees);
+        snprintf(workload, sizeof(workload), "%s-%s", dist_names[dist], order_names[order]);
+    }
+    wall = now_ns() - wall;
+    b->close(b);
+
+    report(b->name, workload, "get", &gets, wall);
+    report(b->name, workload, "free", &frees, wall);
+    free(gets.lat);
+    free(frees.lat);
+}
+
+static void run_backend(struct backend *b) {
+    int dist;
+    int order;
+
+    for(dist = UNIFORM; dist <= POWER_LAW; dist++) {
+        for(order = LIFO; order <= RANDOM; order++) {
+            run_workload(b, dist, order, false);
+        }
+    }
+    run_workload(b, UNIFORM, LIFO, true);
+}
+
+/// ------------------------------------------------------------------------ ///
+
+int main(int argc, const char **argv) {
+    bool core_only = false;
+    int mem;
+    int i;
+
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-c") == 0) {
+            core_only = true;
+        } else if(strcmp(argv[i], "-m") == 0) {
+            csv = true;
+        }
+    }
+
+    if(csv) {
+        printf("backend,workload,op,count,failed,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+    } else {
+        printf("%d byte arena in blocks of %d, %d blocks live, %d gets per workload\n",
+            ARENA_SIZE, ARENA_BLOCK_SIZE, WINDOW, WORKLOAD_OPS);
+        printf("%-7s %-18s %-5s %8s %8s %12s %9s %9s %9s %9s\n", "backend", "workload", "op", "count",
+            "failed", "ops/sec", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    }
+    run_backend(&core_backend);
+
+    if(core_only) {
+        return 0;
+    }
+    mem = open("/dev/mem_dev", O_RDWR);
+    if(mem < 0) {
+        fprintf(stderr, "/dev/mem_dev is not there, so only the core was run\n");
+        return 0;
+    }
+    close(mem);
+    run_backend(&device_backend);
+
+    return 0;
+}
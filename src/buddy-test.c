@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include "buddy-ioctl.c"
 
@@ -32,11 +33,13 @@ void franco_test() {
 // is expected to fail
 void fragmentation_test() {
     int mem, ref;
+    struct geometry_struct geometry;
 
     mem = open("/dev/mem_dev", 0);
+    get_geometry(mem, &geometry);
     printf("Allocating just over half of space...\n");
 
-    ref = get_mem(mem, (MEM_SIZE>>1) + 1);
+    ref = get_mem(mem, (geometry.mem_size>>1) + 1);
     printf("-Expected: %d, Actual: %d\n", 0, ref); // Should start at beginning
     printf("Allocating 1 byte (should fail)...\n"); // Not possible because of fragmentation
     ref = get_mem(mem, 1);
@@ -49,12 +52,25 @@ void fragmentation_test() {
     printf("-Expected: %d, Actual: %d\n", 0, ref);
 
     free_mem(mem, 0);
+
+    printf("Allocating just over half of space exactly...\n");
+    ref = get_mem_exact(mem, (geometry.mem_size>>1) + 1);
+    printf("-Expected: %d, Actual: %d\n", 0, ref);
+    printf("Allocating 1 byte (should pass, the unused tail was given back)...\n");
+    ref = get_mem(mem, 1);
+    printf("-Expected: %d, Actual: %d\n", (geometry.mem_size>>1) + geometry.block_size, ref);
+    printf("Freeing both...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, free_mem(mem, 0));
+    printf("-Expected: %d, Actual: %d\n", 0, free_mem(mem, ref));
+
     close(mem);
 }
 
 /* Miscellany tests.  Mainly to verify buddy allocator logic for
  getting and freeing memory.
  Designed only to test with BUDDY_BLOCK_SIZE = BUDDY_NUM_BLOCKS = 16 
+ and with the module loaded with first_fit=1 (or magazines=0), since the
+ per-CPU magazines hand out small blocks in batches
  
  The first 6 get_mems, if working properly, should cause the buddies to
  follow this sequence:
@@ -81,13 +97,15 @@ void fragmentation_test() {
 */
 void misc_test() {
     int mem;
+    struct geometry_struct geometry;
 
-    if(BUDDY_BLOCK_DEPTH != 4) {
-        printf("    These tests were hardcoded for BUDDY_BLOCK_DEPTH = 4 only\n");
+    mem = open("/dev/mem_dev", 0);
+    get_geometry(mem, &geometry);
+    if(geometry.depth != 4 || geometry.block_size != 16) {
+        printf("    These tests were hardcoded for depth 4 with 16 byte blocks only\n");
+        close(mem);
         return;
     }
-
-    mem = open("/dev/mem_dev", 0);
     // Free and allocate a bunch of memory chunks
 
     printf("Expected: %d, Actual: %d\n", 0 * 16, get_mem(mem, 4 * 16));
@@ -110,6 +128,299 @@ void misc_test() {
     close(mem);
 }
 
+// The mmap'd view of the arena and the ioctl view should always agree:
+// what one writes, the other reads back
+void mmap_test() {
+    int mem, ref;
+    char *view;
+    char buffer[4096];
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    view = map_mem(mem);
+    if(view == NULL) {
+        printf("    Could not mmap /dev/mem_dev\n");
+        close(mem);
+        return;
+    }
+
+    ref = get_mem(mem, 32);
+    printf("Writing through ioctl, reading through the mapping...\n");
+    write_mem(mem, ref, "Hello mapping");
+    printf("-Expected: %s, Actual: %.13s\n", "Hello mapping", view + ref);
+
+    printf("Writing through the mapping, reading through ioctl...\n");
+    memcpy(view + ref, "Hello ioctl", 12);
+    memset(buffer, 0, sizeof(buffer));
+    read_mem(mem, ref, buffer, 12);
+    printf("-Expected: %s, Actual: %s\n", "Hello ioctl", buffer);
+
+    free_mem(mem, ref);
+    unmap_mem(mem, view);
+    close(mem);
+}
+
+// Two handles with private arenas should not see each other's blocks or data
+void private_arena_test() {
+    int mem1, mem2, ref1, ref2;
+    char buffer[4096];
+
+    mem1 = open("/dev/mem_dev", O_RDWR);
+    mem2 = open("/dev/mem_dev", O_RDWR);
+    printf("Creating two private arenas of 256 bytes...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, create_arena(mem1, 256, 16));
+    printf("-Expected: %d, Actual: %d\n", 0, create_arena(mem2, 256, 16));
+
+    printf("Both should hand out their first block...\n");
+    ref1 = get_mem(mem1, 100);
+    ref2 = get_mem(mem2, 100);
+    printf("-Expected: %d, Actual: %d\n", 0, ref1);
+    printf("-Expected: %d, Actual: %d\n", 0, ref2);
+
+    printf("Creating an arena after allocating (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, create_arena(mem1, 256, 16));
+
+    write_mem(mem1, ref1, "first arena");
+    write_mem(mem2, ref2, "second arena");
+    memset(buffer, 0, sizeof(buffer));
+    read_mem(mem1, ref1, buffer, 11);
+    printf("-Expected: %s, Actual: %s\n", "first arena", buffer);
+    read_mem(mem2, ref2, buffer, 12);
+    printf("-Expected: %s, Actual: %s\n", "second arena", buffer);
+
+    printf("Reading the arena as a file: 5 bytes, the last 6, then past its end...\n");
+    printf("-Expected: %d, Actual: %ld\n", 5, pread(mem1, buffer, 5, 0));
+    printf("-Expected: %d, Actual: %ld\n", 6, pread(mem1, buffer, 64, 250));
+    printf("-Expected: %d, Actual: %ld\n", 0, pread(mem1, buffer, 64, 256));
+    printf("Writing past its end (should fail)...\n");
+    printf("-Expected: %d, Actual: %ld\n", -1, pwrite(mem1, "x", 1, 256));
+
+    close(mem1);
+    close(mem2);
+
+    mem1 = open("/dev/mem_dev", O_RDWR);
+    printf("Creating 16 MB in 1 byte blocks (should fail, too much bookkeeping)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, create_arena(mem1, 1<<24, 1));
+    close(mem1);
+}
+
+void binary_test() {
+    int mem, ref;
+    char data[8] = {'a', 0, 'b', 0, 0, 'c', 0, 'd'};
+    char buffer[64];
+    struct mem_iovec iov[2];
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    create_arena(mem, 256, 16);
+    ref = get_mem(mem, 32);
+
+    printf("Writing 8 bytes with embedded zeros...\n");
+    printf("-Expected: %d, Actual: %d\n", 8, write_mem_len(mem, ref, data, 8));
+    memset(buffer, 0xff, sizeof(buffer));
+    read_mem(mem, ref, buffer, 8);
+    printf("-Expected: %d, Actual: %d\n", 0, memcmp(data, buffer, 8));
+
+    printf("Writing past the end of the block (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, write_mem_len(mem, ref + 30, data, 8));
+
+    printf("Reading two segments in one call...\n");
+    iov[0] = (struct mem_iovec){ .ref = ref, .offset = 5, .len = 3, .buf = buffer };
+    iov[1] = (struct mem_iovec){ .ref = ref, .offset = 0, .len = 2, .buf = buffer + 3 };
+    printf("-Expected: %d, Actual: %d\n", 5, readv_mem(mem, iov, 2));
+    printf("-Expected: %d, Actual: %d\n", 0, memcmp(buffer, "c\0da\0", 5));
+
+    printf("A segment that runs out of its block fails the call...\n");
+    iov[1].offset = 31;
+    printf("-Expected: %d, Actual: %d\n", -1, writev_mem(mem, iov, 2));
+
+    close(mem);
+}
+
+void realloc_test() {
+    int mem, ref, other;
+    char buffer[64];
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    create_arena(mem, 256, 16);
+    ref = get_mem(mem, 16);
+    write_mem(mem, ref, "grow me");
+
+    printf("Growing into the free buddy keeps the ref...\n");
+    printf("-Expected: %d, Actual: %d\n", ref, realloc_mem(mem, ref, 64));
+    memset(buffer, 0, sizeof(buffer));
+    read_mem(mem, ref, buffer, 7);
+    printf("-Expected: %s, Actual: %s\n", "grow me", buffer);
+
+    printf("Growing past an allocated buddy moves the data...\n");
+    other = get_mem(mem, 64);
+    printf("-Expected: %d, Actual: %d\n", 128, (ref = realloc_mem(mem, ref, 100)));
+    memset(buffer, 0, sizeof(buffer));
+    read_mem(mem, ref, buffer, 7);
+    printf("-Expected: %s, Actual: %s\n", "grow me", buffer);
+
+    printf("Shrinking keeps the ref and frees the upper half...\n");
+    printf("-Expected: %d, Actual: %d\n", ref, realloc_mem(mem, ref, 50));
+    printf("-Expected: %d, Actual: %d\n", ref + 64, get_mem(mem, 64));
+
+    free_mem(mem, other);
+    close(mem);
+
+    printf("Resizing a block another handle holds in the shared arena (should fail)...\n");
+    mem = open("/dev/mem_dev", O_RDWR);
+    other = open("/dev/mem_dev", O_RDWR);
+    ref = get_mem(mem, 16);
+    printf("-Expected: %d, Actual: %d\n", -1, realloc_mem(other, ref, 64));
+    printf("-Expected: %d, Actual: %d\n", -1, realloc_mem(other, ref, 8));
+    printf("It is still the first handle's to free...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, free_mem(mem, ref));
+    close(other);
+    close(mem);
+}
+
+void aligned_test() {
+    int mem;
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    create_arena(mem, 256, 16);
+
+    printf("A small block on a 64 byte boundary...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, get_mem(mem, 16));
+    printf("-Expected: %d, Actual: %d\n", 64, get_mem_aligned(mem, 16, 64));
+    printf("Its buddy is still free for an ordinary request...\n");
+    printf("-Expected: %d, Actual: %d\n", 80, get_mem(mem, 16));
+    printf("An alignment that is not a power of two (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, get_mem_aligned(mem, 16, 48));
+
+    close(mem);
+}
+
+// Handles should keep naming the same data while compaction moves it
+void handle_test() {
+    int mem, h0, h1, h2;
+    char buffer[64];
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    printf("Compacting an arena without handles (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, compact(mem, 0));
+    close(mem);
+
+    mem = open("/dev/mem_dev", O_RDWR);
+    create_handle_arena(mem, 256, 16);
+    h0 = get_mem(mem, 16);
+    h1 = get_mem(mem, 16);
+    h2 = get_mem(mem, 32);
+    write_mem(mem, h1, "moving");
+    printf("The second block starts out after the first...\n");
+    printf("-Expected: %d, Actual: %d\n", 16, resolve_handle(mem, h1));
+
+    printf("Freeing the first and compacting moves the second down...\n");
+    free_mem(mem, h0);
+    printf("-Expected: %d, Actual: %d\n", 1, compact(mem, 0));
+    printf("-Expected: %d, Actual: %d\n", 0, resolve_handle(mem, h1));
+    printf("-Expected: %d, Actual: %d\n", 32, resolve_handle(mem, h2));
+    memset(buffer, 0, sizeof(buffer));
+    read_mem(mem, h1, buffer, 6);
+    printf("-Expected: %s, Actual: %s\n", "moving", buffer);
+    printf("The freed handle is gone...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, resolve_handle(mem, h0));
+
+    close(mem);
+}
+
+// Blocks belong to the handle that got them, and go away with it
+void owner_test() {
+    int mem1, mem2, ref;
+
+    mem1 = open("/dev/mem_dev", O_RDWR);
+    mem2 = open("/dev/mem_dev", O_RDWR);
+    ref = get_mem(mem1, 16);
+    printf("Freeing another handle's block (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, free_mem(mem2, ref));
+    printf("Resetting the shared arena (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, reset_arena(mem1));
+    printf("Closing the owner frees the block...\n");
+    close(mem1);
+    printf("-Expected: %d, Actual: %d\n", ref, get_mem(mem2, 16));
+    close(mem2);
+
+    mem1 = open("/dev/mem_dev", O_RDWR);
+    create_arena(mem1, 256, 16);
+    get_mem(mem1, 100);
+    get_mem(mem1, 16);
+    printf("A reset private arena has room for its whole size again...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, get_mem(mem1, 256));
+    printf("-Expected: %d, Actual: %d\n", 0, reset_arena(mem1));
+    printf("-Expected: %d, Actual: %d\n", 0, get_mem(mem1, 256));
+    close(mem1);
+}
+
+void snapshot_test() {
+    int mem1, mem2, ref1, ref2;
+    char buffer[32];
+
+    mem1 = open("/dev/mem_dev", O_RDWR);
+    create_arena(mem1, 256, 16);
+    ref1 = get_mem(mem1, 100);
+    ref2 = get_mem(mem1, 16);
+    write_mem(mem1, ref2, "snapshot");
+    printf("Saving a snapshot...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, save_snapshot(mem1, "/tmp/buddy-test.snap"));
+    close(mem1);
+
+    mem2 = open("/dev/mem_dev", O_RDWR);
+    get_mem(mem2, 16);
+    printf("Restoring after an allocation (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", -1, load_snapshot(mem2, "/tmp/buddy-test.snap"));
+    close(mem2);
+
+    mem2 = open("/dev/mem_dev", O_RDWR);
+    printf("Restoring it into a new handle...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, load_snapshot(mem2, "/tmp/buddy-test.snap"));
+    read_mem(mem2, ref2, buffer, 9);
+    printf("-Expected: %s, Actual: %s\n", "snapshot", buffer);
+    printf("The restored blocks are still allocated...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, free_mem(mem2, ref1));
+    printf("-Expected: %d, Actual: %d\n", -1, get_mem(mem2, 256));
+    close(mem2);
+    unlink("/tmp/buddy-test.snap");
+}
+
+// The 64-bit calls report errors on the side instead of in the ref
+void abi64_test() {
+    int mem1, mem2;
+    unsigned long long ref1, ref2;
+    struct geometry64_struct geometry;
+    char buffer[32];
+
+    mem1 = open("/dev/mem_dev", O_RDWR);
+    printf("Creating a private arena...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, create_arena64(mem1, 256, 16, 0, BUDDY_POLICY_DEFAULT));
+    get_geometry64(mem1, &geometry);
+    printf("-Expected: %d, Actual: %d\n", 256, (int)geometry.mem_size);
+    printf("Allocating, writing and reading back...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, get_mem64(mem1, 100, 0, &ref1));
+    printf("-Expected: %d, Actual: %d\n", 0, get_mem64(mem1, 16, 64, &ref2));
+    printf("-Expected: %d, Actual: %d\n", 0, (int)(ref2 % 64));
+    write_mem64(mem1, ref2, "abi64\0", 6);
+    read_mem64(mem1, ref2, buffer, 6);
+    printf("-Expected: %s, Actual: %s\n", "abi64", buffer);
+    printf("Reading past the end of the block (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", EINVAL, read_mem64(mem1, ref2, buffer, 17));
+    printf("Allocating more than is left (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", ENOMEM, get_mem64(mem1, 128, 0, &ref2));
+    printf("Freeing twice (the second should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", 0, free_mem64(mem1, ref1));
+    printf("-Expected: %d, Actual: %d\n", EINVAL, free_mem64(mem1, ref1));
+    close(mem1);
+
+    mem1 = open("/dev/mem_dev", O_RDWR);
+    mem2 = open("/dev/mem_dev", O_RDWR);
+    get_mem64(mem1, 16, 0, &ref1);
+    printf("Freeing another handle's block (should fail)...\n");
+    printf("-Expected: %d, Actual: %d\n", EPERM, free_mem64(mem2, ref1));
+    close(mem1);
+    close(mem2);
+}
+
 int main(int argc, const char **argv) {
 
    printf("-------- Running Dr. Franco's tests --------\n");
@@ -121,5 +432,32 @@ int main(int argc, const char **argv) {
    printf("\n------------ Running misc tests ------------\n");
    misc_test();
 
+   printf("\n------------ Running mmap test -------------\n");
+   mmap_test();
+
+   printf("\n--------- Running private arena test -------\n");
+   private_arena_test();
+
+   printf("\n------------ Running binary test -----------\n");
+   binary_test();
+
+   printf("\n------------ Running realloc test ----------\n");
+   realloc_test();
+
+   printf("\n------------ Running aligned test ----------\n");
+   aligned_test();
+
+   printf("\n------------ Running handle test -----------\n");
+   handle_test();
+
+   printf("\n------------ Running owner test ------------\n");
+   owner_test();
+
+   printf("\n----------- Running snapshot test ----------\n");
+   snapshot_test();
+
+   printf("\n------------ Running 64-bit test -----------\n");
+   abi64_test();
+
    return 0;
 }
\ No newline at end of file
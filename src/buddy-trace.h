@@ -0,0 +1,103 @@
+/* Author: Garrett Scholtes
+ * Date:   2015-11-18
+ *
+ * buddy-trace.h - Tracepoints for the buddy allocator, kernel only.
+ * Enable with e.g.
+ *     echo 1 > /sys/kernel/debug/tracing/events/buddy/enable
+ * While disabled, each tracepoint costs a single patched-out branch.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM buddy
+
+#if !defined(BUDDYTRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define BUDDYTRACE_H
+
+#include <linux/tracepoint.h>
+
+// A get_mem of size bytes, which needed a block of the given order (-1 if
+// the arena is too small) and returned ref (-1 on failure) after touching
+// visited tree nodes
+TRACE_EVENT(buddy_get_mem,
+    TP_PROTO(long size, int order, long ref, int visited),
+    TP_ARGS(size, order, ref, visited),
+
+    TP_STRUCT__entry(
+        __field(long, size)
+        __field(int, order)
+        __field(long, ref)
+        __field(int, visited)
+    ),
+
+    TP_fast_assign(
+        __entry->size = size;
+        __entry->order = order;
+        __entry->ref = ref;
+        __entry->visited = visited;
+    ),
+
+    TP_printk("size=%ld order=%d ref=%ld visited=%d",
+        __entry->size, __entry->order, __entry->ref, __entry->visited)
+);
+
+// A free_mem of ref, which found a block of the given order (-1 if ref is out
+// of range) and returned ret after touching visited tree nodes
+TRACE_EVENT(buddy_free_mem,
+    TP_PROTO(long ref, int order, int ret, int visited),
+    TP_ARGS(ref, order, ret, visited),
+
+    TP_STRUCT__entry(
+        __field(long, ref)
+        __field(int, order)
+        __field(int, ret)
+        __field(int, visited)
+    ),
+
+    TP_fast_assign(
+        __entry->ref = ref;
+        __entry->order = order;
+        __entry->ret = ret;
+        __entry->visited = visited;
+    ),
+
+    TP_printk("ref=%ld order=%d ret=%d visited=%d",
+        __entry->ref, __entry->order, __entry->ret, __entry->visited)
+);
+
+DECLARE_EVENT_CLASS(buddy_block,
+    TP_PROTO(long ref, int order),
+    TP_ARGS(ref, order),
+
+    TP_STRUCT__entry(
+        __field(long, ref)
+        __field(int, order)
+    ),
+
+    TP_fast_assign(
+        __entry->ref = ref;
+        __entry->order = order;
+    ),
+
+    TP_printk("ref=%ld order=%d", __entry->ref, __entry->order)
+);
+
+// The block at ref of the given order was split into two buddies
+DEFINE_EVENT(buddy_block, buddy_split,
+    TP_PROTO(long ref, int order),
+    TP_ARGS(ref, order)
+);
+
+// Two buddies were merged into the block at ref of the given order
+DEFINE_EVENT(buddy_block, buddy_merge,
+    TP_PROTO(long ref, int order),
+    TP_ARGS(ref, order)
+);
+
+#endif
+
+// This header lives next to the module rather than in include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE buddy-trace
+#include <trace/define_trace.h>